@@ -15,9 +15,17 @@ LOCAL_SRC_FILES:= \
 	d4lib.c \
 	epson_new.c \
 	hp_new.c \
+	inventory.c \
 	libinklevel.c \
 	linux.c \
+	numeric.c \
 	opensolaris.c \
+	stats.c \
+	stream.c \
+	timing.c \
+	trace.c \
+	transcript.c \
+	transport.c \
 	util.c
 
 LOCAL_C_INCLUDES += \
@@ -50,3 +58,10 @@ include $(BUILD_STATIC_LIBRARY)
 
 # ink
 #include $(LOCAL_PATH)/ink/Android.mk
+
+#############################################################
+# Build the inkd daemon
+#
+
+# inkd
+#include $(LOCAL_PATH)/inkd/Android.mk
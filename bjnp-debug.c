@@ -19,6 +19,8 @@
 #include <unistd.h>		/* usleep */
 #include <stdint.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "bjnp.h"
 
@@ -30,12 +32,45 @@
 
 
 
+/*
+ * Warnings and errors are written right away. Below that, every thread
+ * that logs gets a ring of records, which only it writes to. A flusher
+ * thread, started once bjnp_set_debug_level() enables such records,
+ * takes them out and writes them, so the caller neither waits for the
+ * file nor takes a lock.
+ * When a ring is full, records are dropped and counted, so a ring holds
+ * a burst between two flushes: a DEBUG2 hexdump of a 1 KB reply alone is
+ * some 70 records.
+ */
+
+#define LOG_RING_SIZE 1024	/* records, a power of two */
+#define LOG_RECORD_SIZE 256
+#define LOG_FLUSH_INTERVAL 100000	/* usec */
+
 typedef struct
 {
   bjnp_loglevel_t level;
   char string[10];
 } logtable_entry_t;
 
+typedef struct
+{
+  bjnp_loglevel_t level;
+  int sec;
+  int msec;
+  char text[LOG_RECORD_SIZE];
+} log_record_t;
+
+typedef struct log_ring_s
+{
+  log_record_t records[LOG_RING_SIZE];
+  unsigned int head;		/* next record to write, by the owner */
+  unsigned int tail;		/* next record to flush, by the flusher */
+  unsigned int dropped;
+  int in_use;			/* owned by a thread */
+  struct log_ring_s *next;
+} log_ring_t;
+
 static logtable_entry_t logtable[] = {
   {LOG_NONE, "NONE"},
   {LOG_EMERG, "EMERG"},
@@ -54,18 +89,34 @@ static logtable_entry_t logtable[] = {
  * static data 
  */
 
+bjnp_loglevel_t bjnp_log_level = LOG_WARN;
+
 static bjnp_loglevel_t debug_level = LOG_ERROR;
 static int to_cups = 0;
 static FILE *debug_file = NULL;
 static time_t start_sec = 0;
 static int start_msec;
 
+static log_ring_t *rings = NULL;	/* rings are never freed, only reused */
+static pthread_key_t ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int log_started = 0;	/* the flusher is running */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* 
  * local functions
  */
 void bjnp_get_time (time_t * sec, uint32_t * usec);
 bjnp_loglevel_t str2level (char *level);
 char * level2str (bjnp_loglevel_t level);
+static void log_init (void);
+static void fill_record (log_record_t * record, bjnp_loglevel_t level,
+			 const char *fmt, va_list ap);
+static log_ring_t *get_ring (void);
+static void release_ring (void *ring);
+static void *flusher (void *arg);
+static void flush_rings (void);
+static void write_record (const log_record_t * record);
 
 //#ifndef NDEBUG
 
@@ -126,8 +177,8 @@ str2level (char *level)
 }
 
 void
-bjnp_hexdump (bjnp_loglevel_t level, char *header, const void *d_,
-	      unsigned len)
+bjnp_log_hexdump (bjnp_loglevel_t level, char *header, const void *d_,
+		  unsigned len)
 {
   const uint8_t *d = (const uint8_t *) (d_);
   unsigned ofs, c;
@@ -185,39 +236,51 @@ bjnp_hexdump (bjnp_loglevel_t level, char *header, const void *d_,
 //#endif /* NDEBUG */
 
 void
-bjnp_debug (bjnp_loglevel_t level, const char *fmt, ...)
+bjnp_log (bjnp_loglevel_t level, const char *fmt, ...)
 {
   va_list ap;
-  char printbuf[256];
-  struct timeb timebuf;
-  int sec;
-  int msec;
+  log_ring_t *ring;
+  log_record_t *record;
+  log_record_t now;
+  unsigned int head;
 
-  /* print received data into a string */
-  va_start (ap, fmt);
-  vsnprintf (printbuf, sizeof (printbuf), fmt, ap);
-  va_end (ap);
+  if (level <= LOG_WARN)
+    {
+      /* the records this thread logged before come first */
 
-  /* we only send real errors & warnings to stderr, unless explicitely asked */
+      if (__atomic_load_n (&log_started, __ATOMIC_ACQUIRE))
+	flush_rings ();
 
-  if ((level <= LOG_WARN) || to_cups)
-    fprintf (stderr, "%s: %s", level2str (level), printbuf);
+      va_start (ap, fmt);
+      fill_record (&now, level, fmt, ap);
+      va_end (ap);
 
-  /* other log messages may go to the own logfile */
+      pthread_mutex_lock (&flush_lock);
+      write_record (&now);
+      if (debug_file)
+	fflush (debug_file);
+      pthread_mutex_unlock (&flush_lock);
+      return;
+    }
 
-  if ((level <= debug_level) && debug_file)
-    {
-      ftime (&timebuf);
-      if ((msec = timebuf.millitm - start_msec) < 0)
-	{
-	  msec += 1000;
-	  timebuf.time -= 1;
-	}
-      sec = timebuf.time - start_sec;
+  if (!__atomic_load_n (&log_started, __ATOMIC_ACQUIRE)
+      || (ring = get_ring ()) == NULL)
+    return;
 
-      fprintf (debug_file, "%s: %03d.%03d %s", level2str (level), sec, msec,
-	       printbuf);
+  head = ring->head;
+  if (head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+    {
+      __atomic_fetch_add (&ring->dropped, 1, __ATOMIC_RELAXED);
+      return;
     }
+
+  record = &ring->records[head & (LOG_RING_SIZE - 1)];
+
+  va_start (ap, fmt);
+  fill_record (record, level, fmt, ap);
+  va_end (ap);
+
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
 void
@@ -230,6 +293,7 @@ bjnp_set_debug_level (char *level)
   struct timeb timebuf;
   char loglevel[16];
   char *separator;
+  char *logfile;
 
   ftime (&timebuf);
   start_sec = timebuf.time;
@@ -262,9 +326,188 @@ bjnp_set_debug_level (char *level)
       level[15] = '\0';
       debug_level = str2level (level);
     }
-  if ((debug_file = fopen (LOGFILE, "w")) == NULL)
+
+  /* the log goes to stderr unless a file is named in the environment */
+
+  if (debug_file && debug_file != stderr)
+    fclose (debug_file);
+
+  if ((logfile = getenv (LOGFILE_ENV)) == NULL || *logfile == '\0')
+    debug_file = stderr;
+  else if ((debug_file = fopen (logfile, "w")) == NULL)
     bjnp_debug (LOG_WARN, "Can not open logfile: %s - %s\n",
-		LOGFILE, strerror (errno));
+		logfile, strerror (errno));
+
+  /* the highest level any record is written at */
+
+  if (to_cups)
+    bjnp_log_level = LOG_END;
+  else if (debug_file && debug_level > LOG_WARN)
+    bjnp_log_level = debug_level;
+  else
+    bjnp_log_level = LOG_WARN;
+
+  if (bjnp_log_level > LOG_WARN)
+    pthread_once (&log_once, log_init);
 
   bjnp_debug (LOG_INFO, "BJNP debug level = %s\n", level2str (debug_level));
 }
+
+static void
+log_init (void)
+{
+  pthread_t thread;
+  sigset_t all;
+  sigset_t old;
+
+  pthread_key_create (&ring_key, release_ring);
+
+  /* the flusher must not take signals meant for the caller, e.g. SIGALRM */
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  if (pthread_create (&thread, NULL, flusher, NULL) == 0)
+    pthread_detach (thread);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  atexit (flush_rings);
+
+  __atomic_store_n (&log_started, 1, __ATOMIC_RELEASE);
+}
+
+static void
+fill_record (log_record_t * record, bjnp_loglevel_t level, const char *fmt,
+	     va_list ap)
+{
+  struct timeb timebuf;
+
+  record->level = level;
+
+  ftime (&timebuf);
+  if ((record->msec = timebuf.millitm - start_msec) < 0)
+    {
+      record->msec += 1000;
+      timebuf.time -= 1;
+    }
+  record->sec = timebuf.time - start_sec;
+
+  /* print received data into the record */
+  vsnprintf (record->text, sizeof (record->text), fmt, ap);
+}
+
+/* Returns the ring of the calling thread, reusing one of a thread that
+ * ended once it is flushed
+ */
+
+static log_ring_t *
+get_ring (void)
+{
+  log_ring_t *ring;
+  int unused;
+
+  if ((ring = pthread_getspecific (ring_key)) != NULL)
+    return ring;
+
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next)
+    {
+      unused = 0;
+      if (__atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) == ring->head
+	  && __atomic_compare_exchange_n (&ring->in_use, &unused, 1, 0,
+					  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	break;
+    }
+
+  if (ring == NULL)
+    {
+      if ((ring = calloc (1, sizeof (log_ring_t))) == NULL)
+	return NULL;
+
+      ring->in_use = 1;
+      ring->next = __atomic_load_n (&rings, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&rings, &ring->next, ring, 1,
+					   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+    }
+
+  pthread_setspecific (ring_key, ring);
+  return ring;
+}
+
+static void
+release_ring (void *ring)
+{
+  __atomic_store_n (&((log_ring_t *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void *
+flusher (void *arg)
+{
+  UNUSED (arg);
+
+  while (1)
+    {
+      usleep (LOG_FLUSH_INTERVAL);
+      flush_rings ();
+    }
+
+  return NULL;
+}
+
+/* Called by the flusher and at exit, the lock keeps them apart */
+
+static void
+flush_rings (void)
+{
+  log_ring_t *ring;
+  log_record_t dropped;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int lost;
+
+  pthread_mutex_lock (&flush_lock);
+
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next)
+    {
+      head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+
+      for (tail = ring->tail; tail != head; tail++)
+	write_record (&ring->records[tail & (LOG_RING_SIZE - 1)]);
+
+      __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+
+      if ((lost = __atomic_exchange_n (&ring->dropped, 0,
+				       __ATOMIC_RELAXED)) != 0)
+	{
+	  dropped.level = LOG_WARN;
+	  dropped.sec = dropped.msec = 0;
+	  snprintf (dropped.text, sizeof (dropped.text),
+		    "%u log records dropped\n", lost);
+	  write_record (&dropped);
+	}
+    }
+
+  if (debug_file)
+    fflush (debug_file);
+
+  pthread_mutex_unlock (&flush_lock);
+}
+
+static void
+write_record (const log_record_t * record)
+{
+  int on_stderr = (record->level <= LOG_WARN) || to_cups;
+
+  /* we only send real errors & warnings to stderr, unless explicitely asked */
+
+  if (on_stderr)
+    fprintf (stderr, "%s: %s", level2str (record->level), record->text);
+
+  /* other log messages may go to the own logfile */
+
+  if ((record->level <= debug_level) && debug_file
+      && !(on_stderr && debug_file == stderr))
+    fprintf (debug_file, "%s: %03d.%03d %s", level2str (record->level),
+	     record->sec, record->msec, record->text);
+}
@@ -25,6 +25,11 @@
 
 #include "bjnp.h"
 #include "inklevel.h"
+#include "stream.h"
+#include "timing.h"
+#include "probes.h"
+#include "trace.h"
+#include "transport.h"
 
 #ifdef HAVE_GETIFADDRS
 #include <ifaddrs.h>
@@ -52,7 +57,7 @@ static int bjnp_get_address_for_named_printer (const char *device_uri,
 
 static int serial = 0;
 static int session_id;
-struct printer_list list[16];
+struct printer_list list[BJNP_PRINTERS_MAX];
 static int num_printers = 0;
 
 static int
@@ -116,58 +121,63 @@ udp_command (const struct sockaddr_in *addr, char *command, int cmd_len,
    * Returns: length of response or -1 in case of error
    */
 
+  const struct BJNP_command *cmd = (const struct BJNP_command *) command;
+  const struct BJNP_command *resp = (const struct BJNP_command *) response;
   int sockfd;
   int numbytes;
-  fd_set fdset;
-  struct timeval timeout;
   int try;
 
   bjnp_debug (LOG_DEBUG, "Sending UDP command to %s:%d\n",
 	      inet_ntoa (addr->sin_addr), ntohs (addr->sin_port));
 
-  if ((sockfd = socket (PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+  if ((sockfd = transport_dgram_open (addr)) == -1)
     {
-      bjnp_debug (LOG_CRIT, "udp_command: sockfd - %s\n", strerror (errno));
+      bjnp_debug (LOG_CRIT, "udp_command: open - %s\n", strerror (errno));
       return -1;
     }
 
-  if (connect (sockfd, (struct sockaddr *) addr,
-	       (socklen_t) sizeof (struct sockaddr_in)) != 0)
-    {
-      bjnp_debug (LOG_CRIT, "udp_command: connect - %s\n", strerror (errno));
-      return -1;
-    }
+  TIMING_BEGIN (INK_STAGE_EXCHANGE);
 
   for (try = 0; try < 3; try++)
     {
-      if ((numbytes = send (sockfd, command, cmd_len, 0)) != cmd_len)
+      if (try > 0)
+	TIMING_RETRY ();
+
+      if ((numbytes = transport_dgram_send (sockfd, command, cmd_len))
+	  != cmd_len)
 	{
 	  bjnp_debug (LOG_CRIT, "udp_command: Sent only %d bytes of packet",
 		      numbytes);
 	}
+      TIMING_BYTES_OUT (numbytes);
+      PROBE3 (bjnp_send, cmd->cmd_code, ntohl (cmd->seq_no), numbytes);
+      TRACE_INSTANT (TRACE_BJNP_SEND, TRACE_ARG_SEQ_NO, ntohl (cmd->seq_no));
 
 
-      FD_ZERO (&fdset);
-      FD_SET (sockfd, &fdset);
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+      numbytes = transport_dgram_recv (sockfd, response, resp_len, 1000);
 
-      if (select (sockfd + 1, &fdset, NULL, NULL, &timeout) == 0)
+      if (numbytes == 0)
 	{
-	  bjnp_debug (LOG_CRIT, "udpcommand: No data received (select)...\n");
+	  bjnp_debug (LOG_CRIT, "udpcommand: No data received (timeout)...\n");
+	  TIMING_TIMEOUT ();
 	  continue;
 	}
 
-      if ((numbytes = recv (sockfd, response, resp_len, MSG_WAITALL)) == -1)
+      if (numbytes == -1)
 	{
 	  bjnp_debug (LOG_CRIT, "udp_command: no data received (recv)");
 	  continue;
 	}
-      close (sockfd);
+      TIMING_BYTES_IN (numbytes);
+      PROBE3 (bjnp_recv, resp->cmd_code, ntohl (resp->seq_no), numbytes);
+      TRACE_INSTANT (TRACE_BJNP_RECV, TRACE_ARG_SEQ_NO, ntohl (resp->seq_no));
+      TIMING_END ();
+      transport_close (sockfd);
       return numbytes;
     }
   /* max tries reached, return failure */
-  close (sockfd);
+  TIMING_END ();
+  transport_close (sockfd);
   return -1;
 }
 
@@ -185,6 +195,7 @@ bjnp_get_printer_id (struct sockaddr_in *addr, char *IEEE1284_id)
   int resp_len;
   int id_len;
   char resp_buf[BJNP_RESP_MAX];
+  struct stream_parser parser;
 
   /* set defaults */
 
@@ -202,6 +213,12 @@ bjnp_get_printer_id (struct sockaddr_in *addr, char *IEEE1284_id)
   if (resp_len <= 0)
     return COULD_NOT_READ_FROM_PRINTER;
 
+  /* check that the identity is complete before using its length */
+
+  stream_init (&parser, STREAM_BJNP, NULL);
+  if (!stream_feed (&parser, resp_buf, resp_len))
+    return COULD_NOT_PARSE_RESPONSE_FROM_PRINTER;
+
   bjnp_hexdump (LOG_DEBUG2, "Printer identity:", resp_buf, resp_len);
 
   id = (struct IDENTITY *) resp_buf;
@@ -356,6 +373,15 @@ bjnp_discover_printers (struct printer_list *list)
   fd_set active_fdset;
   struct timeval timeout;
 
+  /* discovery broadcasts on the interfaces of this host, which only the
+     default transport reaches, see set_ink_transport () */
+
+  if (!transport_is_fd ())
+    {
+      bjnp_debug (LOG_DEBUG, "No printer discovery on this transport\n");
+      return 0;
+    }
+
   FD_ZERO (&fdset);
 
   set_cmd (&cmd, CMD_UDP_DISCOVER, 0, 0);
@@ -446,7 +472,7 @@ bjnp_discover_printers (struct printer_list *list)
   while (select (last_socketfd + 1, &active_fdset, NULL, NULL, &timeout) > 0)
     {
       bjnp_debug (LOG_DEBUG, "Select returned, time left %d.%d....\n",
-		  timeout.tv_sec, timeout.tv_usec);
+		  (int) timeout.tv_sec, (int) timeout.tv_usec);
 
       for (i = 0; i < no_sockets; i++)
 	{
@@ -477,6 +503,11 @@ bjnp_discover_printers (struct printer_list *list)
 		    }
 		};
 
+	      /* keep reading, but there is no room for more printers */
+
+	      if (num_printers >= BJNP_PRINTERS_MAX)
+		continue;
+
 
 	      /* printer found, get IP-address and hostname */
 	      get_printer_address (resp_buf,
@@ -588,13 +619,18 @@ bjnp_get_address_for_named_printer (const char *device_uri,
 
   if (*c == ':')
     {
+      c++;
       while ((*c != '\0') && (*c != '/'))
 	{
-	  if ((*c < '0') && (*c > '9'))
+	  if ((*c < '0') || (*c > '9'))
+	    return BJNP_URI_INVALID;
+	  ipport = ipport * 10 + *c - '0';
+	  if (ipport > 65535)
 	    return BJNP_URI_INVALID;
-	  else
-	    ipport = ipport * 10 + *c - '0';
+	  c++;
 	}
+      if (ipport == 0)
+	return BJNP_URI_INVALID;
     }
   else
     ipport = BJNP_PORT_PRINT;
@@ -605,7 +641,9 @@ bjnp_get_address_for_named_printer (const char *device_uri,
   if (*c != '\0')
     return BJNP_URI_INVALID;
 
+  TIMING_BEGIN (INK_STAGE_RESOLVE);
   result = gethostbyname (hostname);
+  TIMING_END ();
 
   if ((result == NULL) || result->h_addrtype != AF_INET)
     {
@@ -636,6 +674,7 @@ bjnp_get_printer_status (const int port_type, const char *device_uri,
   int resp_len;
   int id_len;
   char resp_buf[BJNP_RESP_MAX];
+  struct stream_parser parser;
   struct sockaddr_in addr;
 
   if (port_type == BJNP)
@@ -665,6 +704,10 @@ bjnp_get_printer_status (const int port_type, const char *device_uri,
   if (resp_len <= sizeof (struct BJNP_command))
     return -1;
 
+  stream_init (&parser, STREAM_BJNP, NULL);
+  if (!stream_feed (&parser, resp_buf, resp_len))
+    return COULD_NOT_PARSE_RESPONSE_FROM_PRINTER;
+
   bjnp_hexdump (10, "Printer status:", resp_buf, resp_len);
 
   id = (struct IDENTITY *) resp_buf;
@@ -704,7 +747,11 @@ bjnp_get_id_from_printer_port (const int port, char *device_id)
      we will then not scan again so we do not mess up the ordering */
 
   if (num_printers == 0)
-   bjnp_discover_printers (list);
+    {
+      TIMING_BEGIN (INK_STAGE_RESOLVE);
+      bjnp_discover_printers (list);
+      TIMING_END ();
+    }
 
   if (port < num_printers)
     return bjnp_get_printer_id (&list[port].addr, device_id);
@@ -124,6 +124,7 @@ typedef enum bjnp_paper_status_e
 #define BJNP_SOCK_MAX 256	/* maximum number of open sockets */
 #define BJNP_MODEL_MAX 64	/* max allowed size for make&model */
 #define BJNP_IEEE1284_MAX 1024	/* max. allowed size of IEEE1284 id */
+#define BJNP_PRINTERS_MAX 16	/* max. number of discovered printers */
 #define KEEP_ALIVE_SECONDS 3	/* max interval/2 seconds before we */
 				/* send an empty data packet to the */
 				/* printer */
@@ -158,15 +159,30 @@ typedef enum bjnp_loglevel_e
                                 /* of list */
 } bjnp_loglevel_t;
 
-#define LOGFILE "bjnp_log"
+#define LOGFILE_ENV "BJNP_LOGFILE"	/* names the logfile, else stderr */
 /*
  * debug related functions
+ *
+ * bjnp_debug () and bjnp_hexdump () test the level before anything is
+ * evaluated or formatted, bjnp_log_level is the highest level written.
  */
 
+extern bjnp_loglevel_t bjnp_log_level;
+
+#define bjnp_log_enabled(level) ((level) <= bjnp_log_level)
+
+#define bjnp_debug(level, ...) \
+  do { if (bjnp_log_enabled (level)) bjnp_log (level, __VA_ARGS__); } while (0)
+
+#define bjnp_hexdump(level, header, d, len) \
+  do { if (bjnp_log_enabled (level)) \
+      bjnp_log_hexdump (level, header, d, len); } while (0)
+
 void bjnp_set_debug_level (char *level);
-void bjnp_debug (bjnp_loglevel_t, const char *, ...);
-void bjnp_hexdump (bjnp_loglevel_t level, char *header, const void *d_,
-		   unsigned len);
+void bjnp_log (bjnp_loglevel_t, const char *, ...)
+  __attribute__ ((format (printf, 2, 3)));
+void bjnp_log_hexdump (bjnp_loglevel_t level, char *header, const void *d_,
+		       unsigned len);
 
 int bjnp_get_id_from_named_printer (const int port_number, const char *device_file, char *device_id);
 int bjnp_get_id_from_printer_port (const int port_number, char *device_id);
@@ -0,0 +1,516 @@
+/* bjnpsim.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+/* Simulates Canon BJNP printers for testing bjnp-io.c without one. Every
+ * printer gets its own address, counting up from 127.0.1.1, which Linux
+ * routes to the loopback interface without any setup. The printers answer
+ * CMD_UDP_DISCOVER, CMD_UDP_GET_ID and CMD_UDP_GET_STATUS after a delay,
+ * may lose requests, and are queried with bjnp://127.0.1.1 and so on.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bjnp.h"
+
+#define DEFAULT_ADDRESS "127.0.1.1"
+#define DEFAULT_IDENTITY "MFG:Canon;CMD:BJL,BJRaster3,BSCCe,NCCe,IVEC,IVECPLI;" \
+  "SOJ:BJNP2,BJNPe;MDL:MP630 series;CLS:PRINTER;DES:Canon MP630 series;"
+#define DEFAULT_STATUS "BST:00;DOC:4,00,NO;CHD:CL;" \
+  "CIR:,BK=80,K=70,C=60,M=50,Y=40;"
+#define MAX_EVENTS 64
+
+struct printer {
+  int fd;
+  struct sockaddr_in addr;
+};
+
+/* A reply waiting for its time */
+
+struct pending {
+  unsigned long long due; /* microseconds, CLOCK_MONOTONIC */
+  int printer;
+  int fd;                 /* the socket to send it from */
+  struct sockaddr_in to;
+  struct BJNP_command cmd;
+};
+
+static struct printer *printers = NULL;
+static int printer_count = 1;
+static int broadcast_fd = -1;
+static const char *identity = DEFAULT_IDENTITY;
+static const char *status = DEFAULT_STATUS;
+static unsigned long long latency = 0; /* microseconds */
+static unsigned long long jitter = 0;
+static int loss = 0;                   /* percent */
+
+/* replies as a binary heap ordered by due */
+
+static struct pending *heap = NULL;
+static int heap_size = 0;
+static int heap_capacity = 0;
+
+static unsigned long requests[256];
+static unsigned long replies = 0;
+static unsigned long lost = 0;
+static unsigned long invalid = 0;
+
+static volatile sig_atomic_t terminate = 0;
+
+/* local functions */
+
+static void usage(void);
+static unsigned long long now(void);
+static int open_printers(struct in_addr first, const int port);
+static int open_broadcast(struct in_addr address, const int port);
+static void receive(const int fd, const int printer);
+static int schedule(const int fd, const int printer,
+                    const struct sockaddr_in *to,
+                    const struct BJNP_command *cmd);
+static void send_due(const unsigned long long t);
+static int build_reply(const struct pending *p, char *buffer);
+static void print_counts(void);
+static void on_signal(int sig);
+
+static void usage(void) {
+  printf("bjnpsim [-n <count>] [-a <address>] [-p <port>] [-b <address>]\n");
+  printf("        [-i <identity>] [-s <status>] [-l <ms>] [-j <ms>]\n");
+  printf("        [-x <percent>] | -v\n\n");
+
+  printf("-n simulates count printers, default 1\n");
+  printf("-a is the address of the first printer, default %s\n",
+         DEFAULT_ADDRESS);
+  printf("-p is the port, default %d\n", BJNP_PORT_PRINT);
+  printf("-b also answers discovery broadcasts to address for all printers,\n");
+  printf("   libinklevel keeps only the first %d of them, so discovery of a\n",
+         BJNP_PRINTERS_MAX);
+  printf("   larger fleet cannot be measured through the library\n");
+  printf("-i and -s set the IEEE 1284 id and the status the printers report\n");
+  printf("-l delays every reply by ms milliseconds, -j by up to ms more\n");
+  printf("-x loses percent of the requests\n\n");
+
+  printf("'bjnpsim -n 2000 -l 5 -j 20 -x 1' Simulates 2000 printers at\n");
+  printf("  127.0.1.1 to 127.0.8.208 on a slightly lossy network\n");
+  printf("'ip route add local 10.9.0.0/16 dev lo' makes a range other than\n");
+  printf("  127.0.0.0/8 usable, e.g. to simulate printers behind an interface\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct epoll_event events[MAX_EVENTS];
+  struct sigaction sa;
+  struct in_addr first;
+  struct in_addr broadcast;
+  unsigned long long t;
+  int have_broadcast = 0;
+  int port = BJNP_PORT_PRINT;
+  int epoll_fd;
+  int timeout;
+  int n;
+  int c;
+  int i;
+
+  inet_aton(DEFAULT_ADDRESS, &first);
+
+  while ((c = getopt(argc, argv, "n:a:p:b:i:s:l:j:x:v")) != -1) {
+    switch (c) {
+    case 'n':
+      printer_count = atoi(optarg);
+      if (printer_count <= 0) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'a':
+      if (inet_aton(optarg, &first) == 0) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'b':
+      if (inet_aton(optarg, &broadcast) == 0) {
+        usage();
+        return 1;
+      }
+      have_broadcast = 1;
+      break;
+    case 'i':
+      identity = optarg;
+      break;
+    case 's':
+      status = optarg;
+      break;
+    case 'l':
+      latency = atoi(optarg) * 1000ULL;
+      break;
+    case 'j':
+      jitter = atoi(optarg) * 1000ULL;
+      break;
+    case 'x':
+      loss = atoi(optarg);
+      if (loss < 0 || loss > 100) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'v':
+      printf("%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  /* bjnp-io.c copies the identity into a buffer of BJNP_IEEE1284_MAX */
+
+  if (strlen(identity) >= BJNP_IEEE1284_MAX ||
+      strlen(status) >= BJNP_IEEE1284_MAX) {
+    fprintf(stderr, "The identity and the status must be shorter than %d\n",
+            BJNP_IEEE1284_MAX);
+    return 1;
+  }
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+
+  if (open_printers(first, port) != 0) {
+    return 1;
+  }
+
+  for (i = 0; i < printer_count; i++) {
+    events[0].events = EPOLLIN;
+    events[0].data.u32 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, printers[i].fd, &events[0]);
+  }
+
+  if (have_broadcast) {
+    if ((broadcast_fd = open_broadcast(broadcast, port)) < 0) {
+      return 1;
+    }
+
+    events[0].events = EPOLLIN;
+    events[0].data.u32 = printer_count;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, broadcast_fd, &events[0]);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal; /* no SA_RESTART, so epoll_wait() returns */
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  srandom(time(NULL) ^ getpid());
+
+  printf("Simulating %d printers from %s port %d\n", printer_count,
+         inet_ntoa(first), port);
+  fflush(stdout);
+
+  while (!terminate) {
+    t = now();
+    send_due(t);
+
+    timeout = -1;
+    if (heap_size > 0) {
+      timeout = (heap[0].due - t + 999) / 1000;
+    }
+
+    if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if ((int) events[i].data.u32 == printer_count) {
+        receive(broadcast_fd, -1);
+      } else {
+        receive(printers[events[i].data.u32].fd, events[i].data.u32);
+      }
+    }
+  }
+
+  print_counts();
+
+  return 0;
+}
+
+static unsigned long long now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* One socket per printer, so each has its own address */
+
+static int open_printers(struct in_addr first, const int port) {
+  struct rlimit limit;
+  int i;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < (rlim_t) printer_count + 16) {
+    limit.rlim_cur = printer_count + 16;
+    if (limit.rlim_max < limit.rlim_cur) {
+      limit.rlim_max = limit.rlim_cur;
+    }
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+      perror("setrlimit");
+      return 1;
+    }
+  }
+
+  if ((printers = calloc(printer_count, sizeof(struct printer))) == NULL) {
+    fprintf(stderr, "Not enough memory available.\n");
+    return 1;
+  }
+
+  for (i = 0; i < printer_count; i++) {
+    printers[i].addr.sin_family = AF_INET;
+    printers[i].addr.sin_port = htons(port);
+    printers[i].addr.sin_addr.s_addr = htonl(ntohl(first.s_addr) + i);
+
+    if ((printers[i].fd = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK |
+                                 SOCK_CLOEXEC, IPPROTO_UDP)) < 0 ||
+        bind(printers[i].fd, (struct sockaddr *) &printers[i].addr,
+             sizeof(struct sockaddr_in)) != 0) {
+      fprintf(stderr, "Could not bind to %s:%d: %s\n",
+              inet_ntoa(printers[i].addr.sin_addr), port, strerror(errno));
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* bjnp-io.c broadcasts discovery from the address of each interface and
+ * the printer port, so this binds to the broadcast address only.
+ */
+
+static int open_broadcast(struct in_addr address, const int port) {
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr = address;
+  memset(addr.sin_zero, '\0', sizeof(addr.sin_zero));
+
+  if ((fd = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                   IPPROTO_UDP)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) != 0 ||
+      bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Could not bind to %s:%d: %s\n", inet_ntoa(address),
+            port, strerror(errno));
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Reads all requests waiting on fd and schedules their replies, printer
+ * is -1 for the broadcast socket.
+ */
+
+static void receive(const int fd, const int printer) {
+  char buffer[BJNP_CMD_MAX];
+  struct BJNP_command cmd;
+  struct sockaddr_in from;
+  socklen_t from_length;
+  int length;
+  int i;
+
+  for (;;) {
+    from_length = sizeof(from);
+
+    if ((length = recvfrom(fd, buffer, sizeof(buffer), 0,
+                           (struct sockaddr *) &from, &from_length)) < 0) {
+      return;
+    }
+
+    if ((size_t) length < sizeof(cmd) ||
+        memcmp(buffer, BJNP_STRING, sizeof(cmd.BJNP_id)) != 0) {
+      invalid++;
+      continue;
+    }
+
+    memcpy(&cmd, buffer, sizeof(cmd));
+    requests[cmd.cmd_code]++;
+
+    if (loss > 0 && random() % 100 < loss) {
+      lost++;
+      continue;
+    }
+
+    if (printer >= 0) {
+      schedule(fd, printer, &from, &cmd);
+    } else if (cmd.cmd_code == CMD_UDP_DISCOVER) {
+      for (i = 0; i < printer_count; i++) {
+        schedule(fd, i, &from, &cmd);
+      }
+    }
+  }
+}
+
+static int schedule(const int fd, const int printer,
+                    const struct sockaddr_in *to,
+                    const struct BJNP_command *cmd) {
+  struct pending p;
+  struct pending *grown;
+  int i;
+
+  if (heap_size == heap_capacity) {
+    heap_capacity = (heap_capacity > 0) ? heap_capacity * 2 : 1024;
+    if ((grown = realloc(heap, heap_capacity * sizeof(struct pending)))
+        == NULL) {
+      lost++;
+      return 1;
+    }
+    heap = grown;
+  }
+
+  p.due = now() + latency;
+  if (jitter > 0) {
+    p.due += random() % (jitter + 1);
+  }
+  p.printer = printer;
+  p.fd = fd;
+  p.to = *to;
+  p.cmd = *cmd;
+
+  /* sift up */
+
+  for (i = heap_size++; i > 0 && heap[(i - 1) / 2].due > p.due;
+       i = (i - 1) / 2) {
+    heap[i] = heap[(i - 1) / 2];
+  }
+  heap[i] = p;
+
+  return 0;
+}
+
+static void send_due(const unsigned long long t) {
+  char buffer[BJNP_RESP_MAX];
+  struct pending p;
+  struct pending last;
+  int child;
+  int length;
+  int i;
+
+  while (heap_size > 0 && heap[0].due <= t) {
+    p = heap[0];
+    last = heap[--heap_size];
+
+    /* sift the last one down from the top */
+
+    for (i = 0; (child = 2 * i + 1) < heap_size; i = child) {
+      if (child + 1 < heap_size && heap[child + 1].due < heap[child].due) {
+        child++;
+      }
+      if (last.due <= heap[child].due) {
+        break;
+      }
+      heap[i] = heap[child];
+    }
+    heap[i] = last;
+
+    length = build_reply(&p, buffer);
+
+    if (sendto(p.fd, buffer, length, 0, (struct sockaddr *) &p.to,
+               sizeof(p.to)) == length) {
+      replies++;
+    }
+  }
+}
+
+/* The reply has the header of the command, with the response type. Other
+ * commands than the simulated ones get the header alone.
+ */
+
+static int build_reply(const struct pending *p, char *buffer) {
+  struct BJNP_command *reply = (struct BJNP_command *) buffer;
+  struct INIT_RESPONSE *init = (struct INIT_RESPONSE *) buffer;
+  struct IDENTITY *id = (struct IDENTITY *) buffer;
+  const unsigned char unknown[6] = { 0x00, 0x01, 0x08, 0x00, 0x06, 0x04 };
+  const char *text = NULL;
+  int length = 0;
+
+  *reply = p->cmd;
+  reply->dev_type = BJNP_RES_PRINT;
+
+  switch (p->cmd.cmd_code) {
+  case CMD_UDP_DISCOVER:
+    length = sizeof(struct INIT_RESPONSE) - sizeof(struct BJNP_command);
+    memcpy(init->unknown1, unknown, sizeof(unknown));
+
+    /* a Canon prefix and the number of the printer */
+
+    init->mac_addr[0] = 0x00;
+    init->mac_addr[1] = 0x1e;
+    init->mac_addr[2] = 0x8f;
+    init->mac_addr[3] = p->printer >> 16;
+    init->mac_addr[4] = p->printer >> 8;
+    init->mac_addr[5] = p->printer;
+    memcpy(init->ip_addr, &printers[p->printer].addr.sin_addr, 4);
+    break;
+  case CMD_UDP_GET_ID:
+    text = identity;
+    break;
+  case CMD_UDP_GET_STATUS:
+    text = status;
+    break;
+  }
+
+  if (text != NULL) {
+    /* the length includes itself */
+
+    length = sizeof(id->id_len) + strlen(text);
+    id->id_len = htons(length);
+    memcpy(id->id, text, strlen(text));
+  }
+
+  reply->payload_len = htonl(length);
+
+  return sizeof(struct BJNP_command) + length;
+}
+
+static void print_counts(void) {
+  printf("discover %lu, get id %lu, get status %lu, replies %lu, "
+         "lost %lu, invalid %lu\n", requests[CMD_UDP_DISCOVER],
+         requests[CMD_UDP_GET_ID], requests[CMD_UDP_GET_STATUS], replies,
+         lost, invalid);
+}
+
+static void on_signal(int sig) {
+  (void) sig;
+  terminate = 1;
+}
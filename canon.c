@@ -22,11 +22,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "internal.h"
 #include "inklevel.h"
 #include "platform_specific.h"
 #include "util.h"
 #include "bjnp.h"
 #include "canon.h"
+#include "numeric.h"
+#include "timing.h"
+#include "probes.h"
+#include "transport.h"
 
 #ifdef __ANDROID__
 #include <cutils/log.h>
@@ -42,9 +47,6 @@
 /* shortcut to compute string length */
 #define GET_STR_LENGTH(var) (sizeof((var))-1)
 
-/* from an input string, this function encodes the datagram to send */
-static int makeCommand_canon(const char *cmd, int cmdLen, char *data);
-
 /* Some taken from CanonUtil::CanonUtilStatus.c */
 typedef unsigned short levelTab[MAX_CARTRIDGE_TYPES];
 
@@ -286,18 +288,47 @@ const static int MAX_NUMBER_OF_MODELS =
  * b9-... : data (SSR=...)
  */
 
+#define SSR_COMMAND "SSR=BST,SFA,CHD,CIL,CIR,HRI,DBS,DWS,DOC,DSC,DJS,CTK,HCF;"
+#define SSR_COMMAND_LENGTH GET_STR_LENGTH(SSR_COMMAND)
+
+struct canon_command {
+  char header[3];
+  unsigned char command_length[2];
+  char separator[2];
+  unsigned char data_length[2];
+  char data[SSR_COMMAND_LENGTH];
+};
+
+/* The get colors command, put together by the compiler */
+
+static const struct canon_command cmdGetColors = {
+  { '\x1b', '[', 'K' },
+  { (SSR_COMMAND_LENGTH + 4) & 0xff, (SSR_COMMAND_LENGTH + 4) >> 8 },
+  { '\x00', '\x1e' },
+  { (SSR_COMMAND_LENGTH + 2) >> 8, (SSR_COMMAND_LENGTH + 2) & 0xff },
+  SSR_COMMAND
+};
+
+STATIC_ASSERT(sizeof(cmdGetColors) == 9 + SSR_COMMAND_LENGTH, 
+              canon_command_length);
+
+/* If reply_hash is not NULL, it is the hash of the previous reply or 0.
+ * When the reply did not change, REPLY_UNCHANGED is returned without
+ * decoding it again.
+ */
+
 int get_ink_level_canon(const int port, const char* device_file, 
-                        const int portnumber, struct ink_level *level) {
+                        const int portnumber, struct ink_level *level,
+                        unsigned int *reply_hash) {
   int fd;
-  char cmdGetColors[] = 
-    "SSR=BST,SFA,CHD,CIL,CIR,HRI,DBS,DWS,DOC,DSC,DJS,CTK,HCF;";
-  char command[256];
   int length;
   int i = 0;
   char buffer[BUFLEN];
   char *indexDOC = NULL, *indexDWS = NULL, *indexCHD = NULL, *indexCIR = NULL;
   int retry = 6; /* You can change this, but keep same parity */
   levelTab lt;
+  struct stream_parser parser;
+  unsigned int hash;
 
   if ((port == BJNP) || (port == CUSTOM_BJNP)) {
     bjnp_get_printer_status(port, device_file,  portnumber, buffer);
@@ -318,28 +349,31 @@ int get_ink_level_canon(const int port, const char* device_file,
       }
 
       /* Get colors command */
-      length = makeCommand_canon(cmdGetColors,
-				 GET_STR_LENGTH(cmdGetColors),
-				 command);
-
-      i = write(fd, command, length);
-      if (i < length) {
+      TIMING_BEGIN(INK_STAGE_EXCHANGE);
+      i = transport_write(fd, &cmdGetColors, sizeof(cmdGetColors));
+      TIMING_BYTES_OUT(i);
+      PROBE2(canon_command, fd, i);
+      if (i < (int) sizeof(cmdGetColors)) {
 
 #ifdef DEBUG
 	printf("Could not send command to printer\n");
 #endif
 
-	close(fd);
+	TIMING_END();
+	close_printer_device(fd);
 	return COULD_NOT_WRITE_TO_PRINTER;
       }
 
-      length = read_from_printer(fd, buffer, BUFLEN, 0);
+      stream_init(&parser, STREAM_CANON, SSR_COMMAND);
+      length = read_reply_from_printer(fd, buffer, BUFLEN, 0, &parser);
+      TIMING_END();
+      PROBE2(canon_response, fd, length);
       if (length <= 0) {
 
 #ifdef DEBUG    
 	printf("Could not read from printer\n");
 #endif
-	close(fd);
+	close_printer_device(fd);
 	return COULD_NOT_READ_FROM_PRINTER;
       }
       /* Insert a terminator so that whe can do string operations */
@@ -364,8 +398,11 @@ int get_ink_level_canon(const int port, const char* device_file,
       indexCHD = strstr(buffer+2, "CHD:");
       indexCIR = strstr(buffer+2, "CIR:");
     
-      close(fd);
+      close_printer_device(fd);
 
+      if (!indexDOC && !indexDWS && !indexCHD && retry > 1) {
+        TIMING_RETRY();
+      }
     } while (!indexDOC && !indexDWS && !indexCHD && !indexCHD && --retry);
   }
 
@@ -377,6 +414,22 @@ int get_ink_level_canon(const int port, const char* device_file,
 
     return COULD_NOT_PARSE_RESPONSE_FROM_PRINTER;
   }
+
+  if (reply_hash != NULL) {
+    hash = hash_bytes(buffer + 2, strlen(buffer + 2));
+
+    if (*reply_hash != 0 && hash == *reply_hash) {
+
+#ifdef DEBUG
+      printf("Reply unchanged\n");
+#endif
+
+      return REPLY_UNCHANGED;
+    }
+
+    *reply_hash = hash;
+  }
+
   /* Check CIR ->Ink Fill Detail<- exact ink level */
   if(indexCIR) 
     decodeCIR(indexCIR,level);
@@ -424,15 +477,13 @@ int get_ink_level_canon(const int port, const char* device_file,
 int get_ink_level_canon_simple(const int mfd, const int port,
       const char* device_file, const int portnumber, struct ink_level *level) {
   int fd = mfd;
-  char cmdGetColors[] =
-    "SSR=BST,SFA,CHD,CIL,CIR,HRI,DBS,DWS,DOC,DSC,DJS,CTK,HCF;";
-  char command[256];
   int length;
   int i = 0;
   char buffer[BUFLEN];
   char *indexDOC = NULL, *indexDWS = NULL, *indexCHD = NULL, *indexCIR = NULL;
   int retry = 6; /* You can change this, but keep same parity */
   levelTab lt;
+  struct stream_parser parser;
 
   if ((port == BJNP) || (port == CUSTOM_BJNP)) {
     bjnp_get_printer_status(port, device_file,  portnumber, buffer);
@@ -454,28 +505,31 @@ int get_ink_level_canon_simple(const int mfd, const int port,
       }
 
       /* Get colors command */
-      length = makeCommand_canon(cmdGetColors,
-				 GET_STR_LENGTH(cmdGetColors),
-				 command);
-
-      i = write(fd, command, length);
-      if (i < length) {
+      TIMING_BEGIN(INK_STAGE_EXCHANGE);
+      i = transport_write(fd, &cmdGetColors, sizeof(cmdGetColors));
+      TIMING_BYTES_OUT(i);
+      PROBE2(canon_command, fd, i);
+      if (i < (int) sizeof(cmdGetColors)) {
 
         #ifdef DEBUG
         printf("Could not send command to printer\n");
         #endif
 
-        close(fd);
+        TIMING_END();
+        transport_close(fd);
         return COULD_NOT_WRITE_TO_PRINTER;
       }
 
-      length = read_from_printer(fd, buffer, BUFLEN, 0);
+      stream_init(&parser, STREAM_CANON, SSR_COMMAND);
+      length = read_reply_from_printer(fd, buffer, BUFLEN, 0, &parser);
+      TIMING_END();
+      PROBE2(canon_response, fd, length);
       if (length <= 0) {
 
         #ifdef DEBUG
         printf("Could not read from printer\n");
         #endif
-        close(fd);
+        transport_close(fd);
         return COULD_NOT_READ_FROM_PRINTER;
       }
       /* Insert a terminator so that whe can do string operations */
@@ -749,69 +803,11 @@ static void decodeCIR(char *s, struct ink_level *level) {
   for(i = 0; i < NO_CARTRIDGES; i++) { 
     if ((cart_level=strstr(s,cartridges[i].key)) != 0) {
       level->levels[level_index][INDEX_TYPE] = cartridges[i].type;
-      sscanf(cart_level+strlen(cartridges[i].key),
-             "%hd",&level->levels[level_index][INDEX_LEVEL]);
+      level->levels[level_index][INDEX_LEVEL] = 
+        decode_decimal(cart_level + strlen(cartridges[i].key));
       level_index++;
     }
   }
   level->status = RESPONSE_VALID;
 }
 
-static int makeCommand_canon(const char * /* in */ cmd, int cmdLen,
-			     char * /* out */ data) {
-  int dataLen = 0;
-  int length;
-  char cmdHdr[]= "\x1b[K"; /* All commands begin with that, 
-                              followed by the request length (2 bytes) */
-  char cmdSeparator[] = "\x00\x1e";
-
-#ifdef DEBUG
-  int i;
-#endif
-
-  /* b0-b2 : First, command header */
-  memcpy(data, cmdHdr, GET_STR_LENGTH(cmdHdr));
-  dataLen = GET_STR_LENGTH(cmdHdr);
-
-  /* b3-b4 : command length.
-     4 bytes are command separator + command data length */
-  length = cmdLen + 4;
-  memcpy(data + dataLen, &length, 1); /* command length, 
-					 may be a 2-byte little 
-					 endian data */
-  memset(data + dataLen + 1, 0, 1); /* this is not the clean way to 
-				       encode a little-endian 
-				       data... */
-  dataLen += 2;
-
-  /* b5-b6 : command separator */
-  memcpy(data + dataLen, cmdSeparator,
-	 GET_STR_LENGTH(cmdSeparator));
-  dataLen += GET_STR_LENGTH(cmdSeparator);
-
-  /* b7-b8 : command data length (including this parameter) */
-  length = cmdLen + 2;
-  memset(data + dataLen, 0, 1); /* this is not the clean way to 
-				   encode a little-endian 
-				   data... */
-  memcpy(data + dataLen + 1, &length, 1); /* command length, 
-					     may be a 2-byte big endian data */
-  dataLen += 2;
-   
-  /* b9+ : the command data finally */
-  memcpy(data + dataLen, cmd, cmdLen);
-  dataLen += cmdLen;
-
-#ifdef DEBUG
-  printf("Command: \n");
-  for (i = 0; i < dataLen; i++) {
-    if (isprint(data[i])) 
-      printf("%c", (unsigned char) data[i]);
-    else 
-      printf("\\x%02x", (unsigned char) data[i]);
-  }
-  printf("\n");
-#endif
-
-  return dataLen;
-}
@@ -7,6 +7,7 @@
  */
 
 int get_ink_level_canon(const int port, const char* device_file,
-			const int portnumber, struct ink_level *level);
+			const int portnumber, struct ink_level *level,
+			unsigned int *reply_hash);
 int get_ink_level_canon_simple(const int mfd, const int port,
 			const char* device_file, const int portnumber, struct ink_level *level);
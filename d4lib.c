@@ -51,6 +51,10 @@
 #include <ctype.h>
 
 #include "d4lib.h"
+#include "timing.h"
+#include "probes.h"
+#include "trace.h"
+#include "transport.h"
 
 
 #ifndef RDTIMEOUT
@@ -71,7 +75,10 @@ int debugD4     = 0;
 typedef void (*signalHandler_t)(int);
 static signalHandler_t sig;
 static int timeoutGot = 0;
-static int _readData(int fd, unsigned char *buf, int len);
+static int _readData(int fd, unsigned char *buf, int len, int *credit);
+static int _sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *answer, int expectedlen);
+static struct channelCredit_s *getCredit(int fd, unsigned char socketID);
+static void resetCredit(int fd, int socketID);
 
 /* commands for the D4 protocol
 
@@ -143,6 +150,34 @@ typedef struct errorMessage_s
 #define RECOVERABLE 0
 #define FATAL       1
 
+/* credit bookkeeping
+
+   Each data packet needs one credit in its direction. Instead of asking
+   for credit before every write and granting credit before every read,
+   we remember per device and socket what is still outstanding:
+
+   sndCredit   credit the device gave us, used up by writeData()
+   rcvCredit   credit we gave the device, used up by readData()
+
+   The ledger is cleared whenever the channel state on the device side
+   is reset (EnterIEEE, Init, OpenChannel, CloseChannel) and, with
+   clearCredit(), when the device is opened or closed.
+*/
+
+#define D4_CREDIT_BATCH 4 /* credit granted to the device in one go */
+#define D4_CREDIT_ENTRIES 32 /* devices times sockets in use */
+
+typedef struct channelCredit_s
+{
+   int used;
+   int fd;
+   unsigned char socketID;
+   int sndCredit;
+   int rcvCredit;
+} channelCredit_t;
+
+static channelCredit_t channelCredit[D4_CREDIT_ENTRIES];
+
 static errorMessage_t errorMessage[] =
 {
    { 0x01, "Unable to begin conversation, try later."              ,0 },
@@ -267,7 +302,8 @@ int SafeWrite(int fd, const void *data, int len)
     printHexValues("SafeWrite: ", data, len);
   do
     {
-      status = write(fd, data, len);
+      status = transport_write(fd, data, len);
+      TIMING_BYTES_OUT(status);
       if(status < len)
 	usleep(d4WrTimeout);
       retries--;
@@ -468,7 +504,8 @@ int readAnswer(int fd, unsigned char *buf, int len)
    while ( total < len )
    {
       SET_TIMER(ti,oti, d4RdTimeout);
-      rd = read(fd, buf+total, len-total);
+      rd = transport_read(fd, buf+total, len-total, TRANSPORT_WAIT);
+      TIMING_BYTES_IN(rd);
       if (debugD4)
 	{
 	  if (first_read)
@@ -565,7 +602,7 @@ static void _flushData(int fd)
      {
        usleep(d4RdTimeout);
        SET_TIMER(ti,oti, d4RdTimeout);
-       rd = read(fd, buf, len);
+       rd = transport_read(fd, buf, len, TRANSPORT_WAIT);
        if (debugD4)
 	 fprintf(stderr, "flush: read: %i %s\n", rd,
 		 rd < 0 && errno != 0 ?strerror(errno) : "");
@@ -580,12 +617,13 @@ static void _flushData(int fd)
 /* Input:  int   fd    file handle                                 */
 /*         char *buf   the data are to be put here                 */
 /*         int   len   the number of bytes to read                 */
+/* Output: int  *credit credit piggybacked by the device           */
 /*                                                                 */
 /* Return: number of bytes read. -1 on error                       */
 /*                                                                 */
 /*******************************************************************/
 
-static int _readData(int fd, unsigned char *buf, int len)
+static int _readData(int fd, unsigned char *buf, int len, int *credit)
 {
    int rd    = 0;
    int total = 0;
@@ -604,7 +642,8 @@ static int _readData(int fd, unsigned char *buf, int len)
    while ( total < 6 )
    {
       SET_TIMER(ti,oti, d4RdTimeout);
-      rd = read(fd, header+total, 6-total);
+      rd = transport_read(fd, header+total, 6-total, TRANSPORT_WAIT);
+      TIMING_BYTES_IN(rd);
       RESET_TIMER(ti,oti);
       if ( rd <= 0 )
       {
@@ -631,6 +670,7 @@ static int _readData(int fd, unsigned char *buf, int len)
 
    if ( total == 6 )
    {
+      *credit = header[4];
       toGet = (header[2] >> 8) + header[3] - 6;
       if (debugD4)
 	fprintf(stderr, "toGet: %i\n", toGet);
@@ -639,7 +679,8 @@ static int _readData(int fd, unsigned char *buf, int len)
       while ( total < toGet )
       {
          SET_TIMER(ti,oti, d4RdTimeout);
-         rd = read(fd, buf+total, toGet-total);
+         rd = transport_read(fd, buf+total, toGet-total, TRANSPORT_WAIT);
+         TIMING_BYTES_IN(rd);
          RESET_TIMER(ti,oti);
          if ( rd <= 0 )
          {
@@ -680,6 +721,20 @@ static int _readData(int fd, unsigned char *buf, int len)
 /*******************************************************************/
 
 static int sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *answer, int expectedlen)
+{
+   int rd;
+
+   /* cmd[6] is the command byte following the 6 byte header */
+   PROBE2(d4_transaction_start, fd, cmd[6]);
+   TRACE_BEGIN(TRACE_D4_TRANSACTION, TRACE_ARG_COMMAND, cmd[6]);
+   rd = _sendReceiveCmd(fd, cmd, len, answer, expectedlen);
+   TRACE_END(TRACE_ARG_RESULT, rd);
+   PROBE3(d4_transaction_end, fd, cmd[6], rd);
+
+   return rd;
+}
+
+static int _sendReceiveCmd(int fd, unsigned char *cmd, int len, unsigned char *answer, int expectedlen)
 {
    int rd;
    if ( (rd = writeCmd(fd, cmd, len ) ) != len )
@@ -767,6 +822,7 @@ Loop:
         if ( buf[i] != 0 )
            break;
       if ( i == rd ) goto Loop;
+      resetCredit(fd, -1);
       return 1;
    }
 }
@@ -796,7 +852,13 @@ int Init(int fd)
    cmd.revision      = 0x10;
     
    rd = sendReceiveCmd(fd, (unsigned char*)&cmd, sizeof(cmd), buf, 9 );
-   return rd == 9 ? 1 : 0;
+   if ( rd == 9 )
+   {
+      /* all channels are closed now */
+      resetCredit(fd, -1);
+      return 1;
+   }
+   return 0;
 }
 
 /*******************************************************************/
@@ -919,6 +981,7 @@ int OpenChannel(int fd, unsigned char sockId, int *sndSz, int *rcvSz)
          }
          *sndSz = (buf[10]<<8) + buf[11];
          *rcvSz = (buf[12]<<8) + buf[13];
+         resetCredit(fd, sockId);
          break;
       }
       else
@@ -956,6 +1019,7 @@ int CloseChannel(int fd, unsigned char socketID)
    buf[sizeof(cmdHeader_t)+1] = socketID;
    buf[sizeof(cmdHeader_t)+2] = 0;
    rd = sendReceiveCmd(fd, buf,10, buf, 10);
+   resetCredit(fd, socketID);
    return rd == 10 ? 1 : rd;
 }
 
@@ -992,6 +1056,7 @@ int CreditRequest(int fd, unsigned char socketID)
    if ( rd == 12 )
    {
       /* this is the credit */
+      getCredit(fd, socketID)->sndCredit += (rBuf[10]*256)+rBuf[11];
       return (rBuf[10]*256)+rBuf[11];
    }
    else
@@ -1032,6 +1097,7 @@ int Credit(int fd, unsigned char socketID, int credit)
    rd = sendReceiveCmd(fd, buf, 11, rBuf, 10);
    if ( rd == 10 )
    {
+      getCredit(fd, socketID)->rcvCredit += credit;
       return 1;
    }
    else
@@ -1052,7 +1118,8 @@ int Credit(int fd, unsigned char socketID, int credit)
 /* Return: credit                                                  */
 /*                                                                 */
 /* Remark: CreditRequest() will be called in a loop as long as     */
-/*         the returned credit is 0                                */
+/*         the returned credit is 0. If there is credit left from  */
+/*         an earlier request, no request is sent at all.          */
 /*                                                                 */
 /*******************************************************************/
 #define MAX_CREDIT_REQUEST 2
@@ -1060,7 +1127,15 @@ int askForCredit(int fd, unsigned char socketID, int *sndSize, int *rcvSize)
 {
    int credit = 0;
    int count  = 0;
-   
+   channelCredit_t *cc = getCredit(fd, socketID);
+
+   if ( cc->sndCredit > 0 )
+   {
+      if ( debugD4 )
+         fprintf(stderr,"credit left: %d\n", cc->sndCredit);
+      return cc->sndCredit;
+   }
+
    while (credit == 0 )
    {
       while((credit=CreditRequest(fd,socketID)) == 0  && count < MAX_CREDIT_REQUEST )
@@ -1171,7 +1246,13 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
    }
 
    if (  wr > 6 )
+   {
+      channelCredit_t *cc = getCredit(fd, socketID);
+
       wr -= 6;
+      if ( cc->sndCredit > 0 )
+         cc->sndCredit--;
+   }
    else
       wr = -1;
    return wr;
@@ -1181,7 +1262,7 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
 /*******************************************************************/
 /* Function readData()                                             */
 /*        Convenience function                                     */
-/*        give credit and read then the expected datas             */
+/*        give credit if needed and read then the expected datas   */
 /* Input:  int   fd    file handle                                 */
 /*         unsigned char    socketID  the destination socket                  */
 /*         unsigned char   *buf       the datas to be send                    */
@@ -1194,18 +1275,32 @@ int writeData(int fd, unsigned char socketID, const unsigned char *buf, int len,
 int readData(int fd, unsigned char socketID, unsigned char *buf, int len)
 {
    int ret;
-   /* give credit */
-   if ( Credit(fd, socketID, 1) == 1 )
+   int credit = 0;
+   channelCredit_t *cc = getCredit(fd, socketID);
+
+   /* give credit, if the device has none left */
+   if ( cc->rcvCredit <= 0 )
    {
+      if ( Credit(fd, socketID, D4_CREDIT_BATCH) != 1 &&
+           Credit(fd, socketID, 1) != 1 )
+      {
+         return -1;
+      }
       /* wait a little bit */
       usleep(1000);
-      ret = _readData(fd, buf, len);
-      return ret; 
    }
-   else
+   ret = _readData(fd, buf, len, &credit);
+   if ( ret > 0 )
    {
-      return -1;
+      /* only a packet with data used up the credit */
+      cc->rcvCredit--;
+   }
+   if ( ret >= 0 )
+   {
+      /* the device may piggyback credit for us on its data */
+      cc->sndCredit += credit;
    }
+   return ret; 
 }
 
 /*******************************************************************/
@@ -1233,6 +1328,8 @@ void flushData(int fd, unsigned char socketID)
 	   /* wait a little bit */
 	   usleep(1000);
 	   _flushData(fd);
+	   /* whatever the device had, it has been used up now */
+	   getCredit(fd, socketID)->rcvCredit = 0;
 	 }
      }
    else
@@ -1254,11 +1351,88 @@ static void clearSndBuf(int fd)
    struct itimerval ti, oti;
    
    SET_TIMER(ti,oti, d4RdTimeout);
-   while ( read(fd, buf, sizeof(buf) ) > 0 )
+   while ( transport_read(fd, buf, sizeof(buf), TRANSPORT_WAIT) > 0 )
       SET_TIMER(ti,oti, d4RdTimeout);
    RESET_TIMER(ti,oti);
 }
 
+/*******************************************************************/
+/* Function getCredit()                                            */
+/*        find the ledger entry of a socket on a device            */
+/*                                                                 */
+/* Input:  int   fd        file handle                             */
+/*         unsigned char   socketID  the socket                    */
+/*                                                                 */
+/* Return: the entry, a new one starts without credit. If all are  */
+/*         in use, an empty one that is not kept.                  */
+/*                                                                 */
+/*******************************************************************/
+
+static channelCredit_t *getCredit(int fd, unsigned char socketID)
+{
+   static channelCredit_t spare;
+   int i;
+   int unused = -1;
+
+   for ( i = 0; i < D4_CREDIT_ENTRIES; i++ )
+   {
+      if ( ! channelCredit[i].used )
+      {
+         if ( unused < 0 )
+            unused = i;
+      }
+      else if ( channelCredit[i].fd == fd &&
+                channelCredit[i].socketID == socketID )
+         return &channelCredit[i];
+   }
+
+   if ( unused < 0 )
+   {
+      memset(&spare, 0, sizeof(spare));
+      return &spare;
+   }
+
+   memset(&channelCredit[unused], 0, sizeof(channelCredit_t));
+   channelCredit[unused].used     = 1;
+   channelCredit[unused].fd       = fd;
+   channelCredit[unused].socketID = socketID;
+   return &channelCredit[unused];
+}
+
+/*******************************************************************/
+/* Function resetCredit()                                          */
+/*        forget about outstanding credit                          */
+/*                                                                 */
+/* Input:  int   fd        file handle                             */
+/*         int   socketID  the socket, -1 for all sockets          */
+/*                                                                 */
+/*******************************************************************/
+
+static void resetCredit(int fd, int socketID)
+{
+   int i;
+
+   for ( i = 0; i < D4_CREDIT_ENTRIES; i++ )
+   {
+      if ( channelCredit[i].used && channelCredit[i].fd == fd &&
+           ( socketID < 0 || channelCredit[i].socketID == socketID ) )
+         channelCredit[i].used = 0;
+   }
+}
+
+/*******************************************************************/
+/* Function clearCredit()                                          */
+/*        forget the credit of a device that is opened or closed   */
+/*                                                                 */
+/* Input:  int   fd    file handle                                 */
+/*                                                                 */
+/*******************************************************************/
+
+void clearCredit(int fd)
+{
+   resetCredit(fd, -1);
+}
+
 void setDebug(int debug)
 {
   debugD4 = debug;
@@ -37,6 +37,7 @@ extern int writeData(int fd, unsigned char socketID, const unsigned char *buf, i
 extern int readData(int fd, unsigned char socketID, unsigned char *buf, int len);
 extern int readAnswer(int fd, unsigned char *buf, int len);
 extern void flushData(int fd, unsigned char socketID);
+extern void clearCredit(int fd);
 extern void setDebug(int debug);
 
 extern int d4WrTimeout;
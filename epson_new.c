@@ -10,40 +10,43 @@
 
 #include "config.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
-#include <stdarg.h>
+#include <sys/stat.h>
 
+#include "internal.h"
 #include "inklevel.h"
 #include "platform_specific.h"
 #include "epson_new.h"
 #include "d4lib.h"
+#include "util.h"
+#include "numeric.h"
+#include "timing.h"
 
 static int do_status_command_internal(void);
 static int initialize_printer();
-static void exit_packet_mode_old(int do_init);
 static int open_raw_device(void);
 static int init_packet(int fd, int force);
-static void do_remote_cmd(const char *cmd, int nargs, ...);
-static void add_resets(int count);
-static void do_new_status(char *buf, int bytes);
+static void do_new_status(const unsigned char *buf, int bytes);
 static void do_old_status(const char *buf);
 static void print_old_ink_levels(const char *ind);
-static void start_remote_sequence(void);
-static void end_remote_sequence(void);
 static const char *looking_at_command(const char *buf, const char *cmd);
 static const char *find_group(const char *buf);
-static int get_digit(char digit);
+static void make_cache_key(char *key);
+static struct epson_capabilities *lookup_capabilities(const char *key);
+static void store_capabilities(const char *key);
+static void forget_capabilities(const char *key);
+static void load_capability_file(void);
+static void save_capability_file(void);
 
 extern int open_printer_device(const int port, const char* device_file, 
                                const int portnumber);
-extern int read_from_printer(int fd, char *buf, int bufsize, int nonblocking);
 
-static char printer_cmd[1025];
-static int bufpos = 0;
 static int isnew = 0;
 static volatile int alarm_interrupt;
 static int send_size = 0x0200;
@@ -54,9 +57,71 @@ static int my_port;
 static char my_device[256];
 static int my_portnumber;
 static struct ink_level *my_level;
+static struct epson_status *my_status;
+
+/* The commands sent to the printer never change, so they are put together
+ * here once instead of on every query.
+ */
+
+#define REMOTE_SEQUENCE_START "\033@\033(R\010\000\000REMOTE1"
+#define REMOTE_SEQUENCE_END "\033\000\000\000\033\000"
+#define RESET "\033\000"
+#define EXIT_PACKET_MODE "\000\000\000\033\001@EJL 1284.4\n@EJL     \n\033@"
+
+/* "ST" with two parameter bytes, the second one switches status on or off */
+#define REMOTE_STATUS(on) \
+  REMOTE_SEQUENCE_START "ST\002\000\000" on REMOTE_SEQUENCE_END RESET RESET
+
+static const char status_on_cmd[] = REMOTE_STATUS("\001");
+static const char status_off_cmd[] = REMOTE_STATUS("\000");
+static const char status_off_packet_cmd[] = 
+  EXIT_PACKET_MODE REMOTE_STATUS("\000");
+
+#define STATUS_ON_CMD_LENGTH ((int) sizeof(status_on_cmd) - 1)
+#define STATUS_OFF_CMD_LENGTH ((int) sizeof(status_off_cmd) - 1)
+#define STATUS_OFF_PACKET_CMD_LENGTH ((int) sizeof(status_off_packet_cmd) - 1)
+
+STATIC_ASSERT(STATUS_ON_CMD_LENGTH == 15 + 6 + 6 + 4, status_on_cmd_length);
+STATIC_ASSERT(STATUS_OFF_CMD_LENGTH == 15 + 6 + 6 + 4, status_off_cmd_length);
+STATIC_ASSERT(STATUS_OFF_PACKET_CMD_LENGTH == 29 + 15 + 6 + 6 + 4,
+              status_off_packet_cmd_length);
+
+/* What initialize_printer() found out about a printer. It does not change
+ * as long as the printer stays connected, so later queries can go straight
+ * to the status command.
+ */
+
+#define CACHE_KEY_LENGTH 280
+#define MAX_CACHED_PRINTERS 16
+
+struct epson_capabilities {
+  char key[CACHE_KEY_LENGTH];
+  int isnew;
+  int socket_id;
+};
+
+static struct epson_capabilities capabilities[MAX_CACHED_PRINTERS];
+static int num_capabilities = 0;
+static char *capability_file = NULL;
+static int capability_file_loaded = 0;
 
 int get_ink_level_epson(const int port, const char *device_file, 
                         const int portnumber, struct ink_level *level) {
+  struct epson_status status;
+
+  return get_epson_status_internal(port, device_file, portnumber, level,
+                                   &status);
+}
+
+int epson_uses_d4(void) {
+  return isnew;
+}
+
+int get_epson_status_internal(const int port, const char *device_file, 
+                              const int portnumber, struct ink_level *level,
+                              struct epson_status *status) {
+  struct epson_capabilities *cap;
+  char key[CACHE_KEY_LENGTH];
   int result;
 
   my_port = port;
@@ -64,50 +129,80 @@ int get_ink_level_epson(const int port, const char *device_file,
   my_device[255] = '\0';
   my_portnumber = portnumber;
   my_level = level;
+  my_status = status;
+  memset(status, 0, sizeof(struct epson_status));
+
+  make_cache_key(key);
+
+  if ((cap = lookup_capabilities(key)) != NULL) {
+
+#ifdef DEBUG
+    printf("Using cached capabilities for %s\n", key);
+#endif
+
+    isnew = cap->isnew;
+    socket_id = cap->socket_id;
+
+    TIMING_BEGIN(INK_STAGE_EXCHANGE);
+    result = do_status_command_internal();
+    TIMING_END();
+
+    switch (result) {
+    case COULD_NOT_GET_CREDIT:
+    case COULD_NOT_WRITE_TO_PRINTER:
+    case COULD_NOT_READ_FROM_PRINTER:
+    case COULD_NOT_PARSE_RESPONSE_FROM_PRINTER:
+    case NO_INK_LEVEL_FOUND:
+      /* The printer does not behave as it did before, probe it again */
 
+#ifdef DEBUG
+      printf("Cached capabilities are stale, probing again\n");
+#endif
+
+      forget_capabilities(key);
+      TIMING_REOPEN();
+      level->status = RESPONSE_INVALID;
+      memset(level->levels, 0, sizeof(level->levels));
+      memset(status, 0, sizeof(struct epson_status));
+      break;
+
+    default:
+      return result;
+    }
+  }
+
+  TIMING_BEGIN(INK_STAGE_EXCHANGE);
   result = initialize_printer();
   if (result == OK) {
+    store_capabilities(key);
     result = do_status_command_internal();
     level = my_level;
   }
+  TIMING_END();
 
   return result;
 }
 
-static void alarm_handler(int sig) {
-  alarm_interrupt = 1;
-}
-
-static void exit_packet_mode_old(int do_init) {
-  static char hdr[] = "\000\000\000\033\001@EJL 1284.4\n@EJL     \n\033@";
-  memcpy(printer_cmd + bufpos, hdr, sizeof(hdr) - 1); /* DON'T include null! */
-
-#ifdef DEBUG
-  printf("Exit packet mode (%d)\n", do_init);
-#endif
+void set_epson_cache_file(const char *filename) {
+  free(capability_file);
+  capability_file = NULL;
+  capability_file_loaded = 0;
 
-  bufpos += sizeof(hdr) - 1;
-  if (!do_init) {
-    bufpos -= 2;
+  if (filename != NULL) {
+    capability_file = strdup(filename);
   }
 }
 
-static void initialize_print_cmd(int do_init) {
-  bufpos = 0;
-
-#ifdef DEBUG
-  printf("Initialize print command\n");
-#endif
-
-  if (isnew) {
-    exit_packet_mode_old(do_init);
-  }
+static void alarm_handler(int sig) {
+  alarm_interrupt = 1;
 }
 
 static int do_status_command_internal() {
   int fd;
   int status;
+  int length;
   int credit;
+  struct stream_parser parser;
   int retry = 4;
   char buf[1024];
 
@@ -161,22 +256,50 @@ static int do_status_command_internal() {
       return COULD_NOT_PARSE_RESPONSE_FROM_PRINTER;
     }
 
+    /* A long status may come in more than one packet */
+
+    stream_init(&parser, STREAM_EPSON, NULL);
+    if (strncmp("@BDC ST", buf, 7) == 0 && 
+        !stream_feed(&parser, buf, status)) {
+      while (status < 1023) {
+        length = readData(fd, socket_id, (unsigned char*) buf + status, 
+                          1023 - status);
+        if (length <= 0 || stream_feed(&parser, buf + status, length)) {
+          status += (length > 0) ? length : 0;
+          break;
+        }
+        status += length;
+      }
+    }
+
     buf[status] = '\0';
 
     if (buf[7] == '2') {
-      do_new_status(buf + 12, status - 12);
+      /* "@BDC ST2\r\n", two bytes length (little endian), data */
+      if (status < 12) {
+        return COULD_NOT_PARSE_RESPONSE_FROM_PRINTER;
+      }
+      length = (unsigned char) buf[10] | ((unsigned char) buf[11] << 8);
+      if (length > status - 12) {
+        length = status - 12;
+      }
+      do_new_status((unsigned char *) buf + 12, length);
     } else {
       do_old_status(buf + 9);
     }
-    
-    CloseChannel(fd, socket_id);
+
+    /* A device kept open for the next query keeps its channel open
+     * too, so the credit d4lib keeps track of can be used then instead
+     * of asking for new credit.
+     */
+
+    if (!is_pooled_device(fd)) {
+      CloseChannel(fd, socket_id);
+    }
   } else {
     do {
-      add_resets(2);
-      initialize_print_cmd(1);
-      do_remote_cmd("ST", 2, 0, 1);
-      add_resets(2);
-      if (SafeWrite(fd, printer_cmd, bufpos) < bufpos) {
+      if (SafeWrite(fd, status_on_cmd, STATUS_ON_CMD_LENGTH) 
+          < STATUS_ON_CMD_LENGTH) {
 
 #ifdef DEBUG
         printf("Cannot write to printer: %s\n", strerror(errno));
@@ -185,10 +308,14 @@ static int do_status_command_internal() {
         return COULD_NOT_WRITE_TO_PRINTER;
       }
       
-      status = read_from_printer(fd, buf, 1024, 1);
+      stream_init(&parser, STREAM_EPSON, NULL);
+      status = read_reply_from_printer(fd, buf, 1024, 1, &parser);
       if (status < 0) {
         return COULD_NOT_READ_FROM_PRINTER;
       }
+      if (!status && retry > 1) {
+        TIMING_RETRY();
+      }
     } while (--retry != 0 && !status);
     
     buf[status] = '\0';
@@ -200,7 +327,7 @@ static int do_status_command_internal() {
     }
   }
 
-  close(fd);
+  close_printer_device(fd);
 
   return OK;
 }
@@ -214,7 +341,7 @@ static int initialize_printer() {
   int status;
   int forced_packet_mode = 0;
   char* pos;
-  char* spos;
+  char* spos = NULL;
   unsigned char buf[1024];
   const char init_str[] = "\033\1@EJL ID\r\n";
 
@@ -254,7 +381,9 @@ static int initialize_printer() {
     status = read_from_printer(fd, (char*)buf, 1024, 1);
 
     if (status <= 0 && tries > 0) {
+      TIMING_BEGIN(INK_STAGE_D4);
       forced_packet_mode = !init_packet(fd, 1);
+      TIMING_END();
       status = 1;
     }
 
@@ -268,10 +397,11 @@ static int initialize_printer() {
       /*
        * We know the printer's not dead.  Try to turn off status and try again.
        */
-      initialize_print_cmd(1);
-      do_remote_cmd("ST", 2, 0, 0);
-      add_resets(2);
-      SafeWrite(fd, printer_cmd, bufpos);
+      if (isnew) {
+        SafeWrite(fd, status_off_packet_cmd, STATUS_OFF_PACKET_CMD_LENGTH);
+      } else {
+        SafeWrite(fd, status_off_cmd, STATUS_OFF_CMD_LENGTH);
+      }
       status = 0;
     }
     
@@ -404,10 +534,12 @@ static int initialize_printer() {
   }
   
   if (isnew && !packet_initialized) {
+    TIMING_BEGIN(INK_STAGE_D4);
     isnew = !init_packet(fd, 0);
+    TIMING_END();
   }
 
-  close(fd);
+  close_printer_device(fd);
 
 #ifdef DEBUG
   printf("new? %s found? %s\n", isnew ? "yes" : "no", found ? "yes" : "no");
@@ -415,6 +547,139 @@ static int initialize_printer() {
   return OK;
 }
 
+/* The cache key identifies the printer by the way it is addressed */
+
+static void make_cache_key(char *key) {
+  snprintf(key, CACHE_KEY_LENGTH, "%d:%d:%s", my_port, my_portnumber,
+           (my_port == CUSTOM_USB) ? my_device : "");
+}
+
+static struct epson_capabilities *lookup_capabilities(const char *key) {
+  int i;
+
+  if (!capability_file_loaded) {
+    load_capability_file();
+  }
+
+  for (i = 0; i < num_capabilities; i++) {
+    if (strcmp(capabilities[i].key, key) == 0) {
+      return &capabilities[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void store_capabilities(const char *key) {
+  struct epson_capabilities *cap;
+
+  if ((cap = lookup_capabilities(key)) == NULL) {
+    if (num_capabilities == MAX_CACHED_PRINTERS) {
+      /* cache full, drop the oldest entry */
+      memmove(&capabilities[0], &capabilities[1],
+              (MAX_CACHED_PRINTERS - 1) * sizeof(struct epson_capabilities));
+      num_capabilities--;
+    }
+    cap = &capabilities[num_capabilities++];
+  }
+
+  strncpy(cap->key, key, CACHE_KEY_LENGTH - 1);
+  cap->key[CACHE_KEY_LENGTH - 1] = '\0';
+  cap->isnew = isnew;
+  cap->socket_id = socket_id;
+
+  save_capability_file();
+}
+
+static void forget_capabilities(const char *key) {
+  struct epson_capabilities *cap;
+
+  if ((cap = lookup_capabilities(key)) != NULL) {
+    num_capabilities--;
+    memmove(cap, cap + 1, (&capabilities[num_capabilities] - cap) *
+            sizeof(struct epson_capabilities));
+    save_capability_file();
+  }
+}
+
+/* The capability file holds one line per printer:
+ * <key> <isnew> <socket id>
+ * The key must not contain tabs. It is written to a new file that is
+ * renamed over the old one, so that another process sharing it never
+ * reads it half written.
+ */
+
+static void load_capability_file(void) {
+  FILE *f;
+  char line[CACHE_KEY_LENGTH + 32];
+  char *field[3];
+  char *c;
+  int i;
+
+  capability_file_loaded = 1;
+
+  if ((capability_file == NULL) || 
+      ((f = fopen(capability_file, "r")) == NULL)) {
+    return;
+  }
+
+  num_capabilities = 0;
+
+  while ((num_capabilities < MAX_CACHED_PRINTERS) && 
+         (fgets(line, sizeof(line), f) != NULL)) {
+    line[strcspn(line, "\n")] = '\0';
+    c = line;
+    for (i = 0; i < 3 && c != NULL; i++) {
+      field[i] = c;
+      if ((c = strchr(c, '\t')) != NULL) {
+        *c++ = '\0';
+      }
+    }
+    if ((i < 3) || (strlen(field[0]) >= CACHE_KEY_LENGTH)) {
+      continue; /* malformed line */
+    }
+
+    strcpy(capabilities[num_capabilities].key, field[0]);
+    capabilities[num_capabilities].isnew = atoi(field[1]);
+    capabilities[num_capabilities].socket_id = atoi(field[2]);
+    num_capabilities++;
+  }
+
+  fclose(f);
+}
+
+static void save_capability_file(void) {
+  char new_file[4096];
+  FILE *f;
+  int fd;
+  int i;
+  int ok;
+
+  if ((capability_file == NULL) ||
+      (snprintf(new_file, sizeof(new_file), "%s.XXXXXX", capability_file) >=
+       (int) sizeof(new_file)) ||
+      ((fd = mkstemp(new_file)) < 0)) {
+    return;
+  }
+
+  if ((fchmod(fd, 0644) != 0) || ((f = fdopen(fd, "w")) == NULL)) {
+    close(fd);
+    unlink(new_file);
+    return;
+  }
+
+  for (i = 0; i < num_capabilities; i++) {
+    fprintf(f, "%s\t%d\t%d\n", capabilities[i].key, 
+            capabilities[i].isnew, capabilities[i].socket_id);
+  }
+
+  ok = !ferror(f);
+
+  if ((fclose(f) != 0) || !ok || (rename(new_file, capability_file) != 0)) {
+    unlink(new_file);
+  }
+}
+
 static int open_raw_device(void) {
   int fd;
 
@@ -493,61 +758,7 @@ static int init_packet(int fd, int force) {
   return OK;
 }
 
-static void do_remote_cmd(const char *cmd, int nargs, ...) {
-  int i;
-  va_list args;
-
-  va_start(args, nargs);
-
-  start_remote_sequence();
-  memcpy(printer_cmd + bufpos, cmd, 2);
-
-#ifdef DEBUG
-  printf("Remote command: %s", cmd);
-#endif
-
-  bufpos += 2;
-  printer_cmd[bufpos] = nargs % 256;
-  printer_cmd[bufpos + 1] = (nargs >> 8) % 256;
-  
-
-#ifdef DEBUG
-  printf(" %02x %02x", (unsigned) printer_cmd[bufpos], 
-         (unsigned) printer_cmd[bufpos + 1]);
-#endif
-
-  if (nargs > 0) {
-    for (i = 0; i < nargs; i++) {
-      printer_cmd[bufpos + 2 + i] = va_arg(args, int);
-
-#ifdef DEBUG
-      printf(" %02x", (unsigned) printer_cmd[bufpos + 2 + i]);
-#endif
-    }
-  }
-
-#ifdef DEBUG
-  printf("\n");
-#endif
-
-  bufpos += 2 + nargs;
-  end_remote_sequence();
-}
-
-static void add_resets(int count) {
-  int i;
-
-#ifdef DEBUG
-  printf("Add %d resets\n", count);
-#endif
-
-  for (i = 0; i < count; i++) {
-    printer_cmd[bufpos++] = '\033';
-    printer_cmd[bufpos++] = '\000';
-  }
-}
-
-static void do_new_status(char *buf, int bytes) {
+static void do_new_status(const unsigned char *buf, int bytes) {
   /* static const char *colors_new[] = { */
   /*   "Black",		/\* 0 *\/ */
   /*   "Photo Black",	/\* 1 *\/ */
@@ -632,70 +843,196 @@ static void do_new_status(char *buf, int bytes) {
 
   static int aux_color_count = sizeof(aux_colors) / sizeof(int);
 
+  struct epson_status *st = my_status;
+  const unsigned char *p;
+  struct epson_ink *ink;
   int i = 0;
   int j;
-  int c = 0;
-  const char *ind;
+  int count;
+  int length;
 
 #ifdef DEBUG
   printf("New format bytes: %d bytes\n", bytes);
 #endif
 
-  while (i < bytes) {
+  if (bytes > EPSON_RAW_LENGTH) {
+    bytes = EPSON_RAW_LENGTH;
+  }
+
+  st->version = EPSON_STATUS_ST2;
+  memcpy(st->raw, buf, bytes);
+  st->raw_length = bytes;
+
+  /* Every field is <header> <length> <length bytes of parameters>.
+   * A field that does not fit completely into the reply ends the parsing.
+   */
+
+  while (i + 2 <= bytes) {
     unsigned hdr = buf[i];
-    unsigned total_param_count = buf[i + 1];
-    unsigned param = buf[i + 2];
+
+    length = buf[i + 1];
+    p = buf + i + 2;
 
 #ifdef DEBUG
-    printf("Header: %x param count: %d\n", hdr, total_param_count);
+    printf("Header: %x param count: %d\n", hdr, length);
 #endif
 
-    if (hdr == 0x0f) {	/* Always report ink */
-      size_t count = (total_param_count - 1) / param;
-      ind = buf + i + 3;
+    if (i + 2 + length > bytes) {
 
 #ifdef DEBUG
-      printf("%18s    %20s\n", "Ink color", "Percent remaining");
+      printf("Field exceeds reply, ignoring the rest\n");
 #endif
 
-      for (j = 0; j < count; j++) {
-        if (ind[0] < color_count) {
+      break;
+    }
 
-#ifdef DEBUG
-          printf("%18d    %20d\n",colors_new[(int) ind[0]], ind[2]);
-#endif
-          
-          my_level->status = RESPONSE_VALID;
-          my_level->levels[c][INDEX_TYPE] = colors_new[(int) ind[0]];
-          my_level->levels[c][INDEX_LEVEL] = (short) ind[2];
-          c++;
-        } else if (ind[j] == 0x40 && ind[1] < aux_color_count) {
+    if (st->num_fields < EPSON_MAX_FIELDS) {
+      st->fields[st->num_fields].header = hdr;
+      st->fields[st->num_fields].length = length;
+      st->fields[st->num_fields].offset = i + 2;
+      st->num_fields++;
+    }
+
+    switch (hdr) {
+    case 0x01: /* printer state */
+      if (length >= 1) {
+        st->state = p[0];
+        st->present |= EPSON_HAS_STATE;
+      }
+      break;
+
+    case 0x02: /* error code */
+      if (length >= 1) {
+        st->error = p[0];
+        st->present |= EPSON_HAS_ERROR;
+      }
+      break;
+
+    case 0x03: /* self print code */
+      if (length >= 1) {
+        st->self_print = p[0];
+        st->present |= EPSON_HAS_SELF_PRINT;
+      }
+      break;
+
+    case 0x04: /* warning codes */
+      for (j = 0; j < length && st->num_warnings < EPSON_MAX_WARNINGS; j++) {
+        st->warnings[st->num_warnings++] = p[j];
+      }
+      st->present |= EPSON_HAS_WARNINGS;
+      break;
+
+    case 0x06: /* paper path */
+      if (length >= 2) {
+        st->paper_path[0] = p[0];
+        st->paper_path[1] = p[1];
+        st->present |= EPSON_HAS_PAPER_PATH;
+      }
+      break;
+
+    case 0x07: /* paper mismatch */
+      if (length >= 1) {
+        st->paper_mismatch = p[0];
+        st->present |= EPSON_HAS_PAPER_MISMATCH;
+      }
+      break;
+
+    case 0x0f: /* ink information, <entry size> followed by the entries */
+      if (length < 1 || p[0] < 3) {
+        break;
+      }
+
+      count = (length - 1) / p[0];
+      st->present |= EPSON_HAS_INK;
 
 #ifdef DEBUG
-          printf("%18d    %20d\n", aux_colors[(int) ind[1]], ind[2]);
+      printf("%18s    %20s\n", "Ink color", "Percent remaining");
 #endif
 
-          my_level->status = RESPONSE_VALID;
-          my_level->levels[c][INDEX_TYPE] = aux_colors[(int) ind[1]];
-          my_level->levels[c][INDEX_LEVEL] = (short) ind[2];
-          c++;
+      for (j = 0; j < count && st->num_inks < MAX_CARTRIDGE_TYPES; j++) {
+        const unsigned char *ind = p + 1 + j * p[0];
+
+        ink = &st->inks[st->num_inks];
+        ink->code = ind[0];
+        ink->aux = ind[1];
+        ink->level = ind[2];
+
+        if (ind[0] < color_count) {
+          ink->type = colors_new[ind[0]];
+        } else if (ind[0] == 0x40 && ind[1] < aux_color_count) {
+          ink->type = aux_colors[ind[1]];
         } else {
 
 #ifdef DEBUG
           printf("%8s 0x%2x 0x%2x    %20d\n",
-                 "Unknown", (unsigned char) ind[0],
-                 (unsigned char) ind[1], ind[2]);
+                 "Unknown", ind[0], ind[1], ind[2]);
 #endif
+
+          continue;
         }
 
-        ind += param;
+#ifdef DEBUG
+        printf("%18d    %20d\n", ink->type, ink->level);
+#endif
+
+        st->num_inks++;
+      }
+      break;
+
+    case 0x13: /* cancel code */
+      if (length >= 1) {
+        st->cancel = p[0];
+        st->present |= EPSON_HAS_CANCEL;
       }
+      break;
+
+    case 0x18: /* stacker (tray) open status */
+      if (length >= 1) {
+        st->tray = p[0];
+        st->present |= EPSON_HAS_TRAY;
+      }
+      break;
+
+    case 0x1c: /* temperature */
+      if (length >= 1) {
+        st->temperature = p[0];
+        st->present |= EPSON_HAS_TEMPERATURE;
+      }
+      break;
+
+    case 0x36: /* paper counters, 4 bytes little endian each */
+      for (j = 0; j + 4 <= length && 
+             st->num_paper_counts < EPSON_MAX_PAPER_COUNTS; j += 4) {
+        st->paper_counts[st->num_paper_counts++] = 
+          (unsigned long) p[j] | ((unsigned long) p[j + 1] << 8) |
+          ((unsigned long) p[j + 2] << 16) | ((unsigned long) p[j + 3] << 24);
+      }
+      st->present |= EPSON_HAS_PAPER_COUNT;
+      break;
+
+    case 0x40: /* serial number */
+      j = (length < EPSON_SERIAL_LENGTH - 1) ? length : EPSON_SERIAL_LENGTH - 1;
+      memcpy(st->serial, p, j);
+      st->serial[j] = '\0';
+      st->present |= EPSON_HAS_SERIAL;
+      break;
     }
-    i += total_param_count + 2;
+
+    i += length + 2;
+  }
+
+  /* The decoded inks are what get_ink_level() reports */
+
+  for (j = 0; j < st->num_inks; j++) {
+    my_level->status = RESPONSE_VALID;
+    my_level->levels[j][INDEX_TYPE] = st->inks[j].type;
+    my_level->levels[j][INDEX_LEVEL] = st->inks[j].level;
   }
 }
 
 static void do_old_status(const char *buf) {
+  my_status->version = EPSON_STATUS_OLD;
+
   do {
     const char *ind;
     
@@ -746,7 +1083,7 @@ static void print_old_ink_levels(const char *ind) {
     
     if (!ind[0] || ind[0] == ';')
       return;
-    val = (get_digit(ind[0]) << 4) + get_digit(ind[1]);
+    val = decode_hex_byte(ind);
 
 #ifdef DEBUG
     printf("%18d    %20d\n", old_colors[i], val);
@@ -755,32 +1092,15 @@ static void print_old_ink_levels(const char *ind) {
     my_level->status = RESPONSE_VALID;
     my_level->levels[c][INDEX_TYPE] = old_colors[i];
     my_level->levels[c][INDEX_LEVEL] = val;
-    c++;
+    my_status->inks[c].type = old_colors[i];
+    my_status->inks[c].level = val;
+    my_status->num_inks = ++c;
+    my_status->present |= EPSON_HAS_INK;
 
     ind += 2;
   }
 }
 
-static void start_remote_sequence(void) {
-  static char remote_hdr[] = "\033@\033(R\010\000\000REMOTE1";
-  memcpy(printer_cmd + bufpos, remote_hdr, sizeof(remote_hdr) - 1);
-  bufpos += sizeof(remote_hdr) - 1;
-
-#ifdef DEBUG
-  printf("Start remote sequence\n");
-#endif
-}
-
-static void end_remote_sequence(void) {  
-  static char remote_trailer[] = "\033\000\000\000\033\000";
-  memcpy(printer_cmd + bufpos, remote_trailer, sizeof(remote_trailer) - 1);
-  bufpos += sizeof(remote_trailer) - 1;
-
-#ifdef DEBUG
-  printf("End remote sequence\n");
-#endif
-}
-
 static const char *looking_at_command(const char *buf, const char *cmd) {
   if (!strncmp(buf, cmd, strlen(cmd))) {
     const char *answer = buf + strlen(cmd);
@@ -803,15 +1123,3 @@ static const char *find_group(const char *buf) {
     return NULL;
   }
 }
-
-static int get_digit(char digit) {
-  if (digit >= '0' && digit <= '9') {
-    return digit - '0';
-  } else if (digit >= 'A' && digit <= 'F') {
-    return digit - 'A' + 10;
-  } else if (digit >= 'a' && digit <= 'f') {
-    return digit - 'a' + 10;
-  } else {
-    return 0;
-  }
-}
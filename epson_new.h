@@ -8,3 +8,10 @@
 
 int get_ink_level_epson(const int port, const char *device_file,
 			const int portnumber, struct ink_level *level);
+int get_epson_status_internal(const int port, const char *device_file,
+			      const int portnumber, struct ink_level *level,
+			      struct epson_status *status);
+
+/* Whether the last printer queried talked D4 (IEEE 1284.4) */
+
+int epson_uses_d4(void);
@@ -9,11 +9,63 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "inklevel.h"
 #include "util.h"
+#include "numeric.h"
 #include "hp_new.h"
 
+/* Layouts of the S: tag, indexed by version */
+
+#define HP_LAYOUT_RECORDS 1
+#define HP_LAYOUT_TAIL 2
+
+#define HP_TAIL_MAX 8
+
+struct hp_tail {
+  int type;
+  int position; /* characters before the end of the tag */
+};
+
+struct hp_layout {
+  int kind;   /* HP_LAYOUT_*, 0 if the version is not supported */
+  int offset; /* HP_LAYOUT_RECORDS: number of records and first record */
+  struct hp_tail tail[HP_TAIL_MAX]; /* HP_LAYOUT_TAIL */
+};
+
+#define HP_RECORD_SIZE 8
+#define HP_RECORD_TYPE 1
+#define HP_RECORD_VALUE 7
+#define HP_TYPE_OWN_HEAD 0x40
+#define HP_TYPE_MASK 0x3f
+
+static const struct hp_layout hp_layouts[] = {
+#define HP_RECORDS(version, offset) \
+  [version] = { HP_LAYOUT_RECORDS, offset, { { 0, 0 } } },
+#define HP_TAIL(version, ...) \
+  [version] = { HP_LAYOUT_TAIL, 0, { __VA_ARGS__ } },
+#include "hp_formats.def"
+#undef HP_RECORDS
+#undef HP_TAIL
+};
+
+#define HP_LAYOUT_COUNT (int) (sizeof(hp_layouts) / sizeof(hp_layouts[0]))
+
+static const unsigned char hp_colors[HP_TYPE_MASK + 1] = {
+#define HP_COLOR(type, cartridge) [type] = cartridge,
+#include "hp_formats.def"
+#undef HP_COLOR
+};
+
+/* Bit n is set if type n is in hp_colors */
+
+static const unsigned long long hp_colors_known = 0
+#define HP_COLOR(type, cartridge) | (1ULL << (type))
+#include "hp_formats.def"
+#undef HP_COLOR
+  ;
+
 /* This function parses the device id of a new HP printer
  * for example HP Deskjet 5550 
  */
@@ -22,21 +74,18 @@ int parse_device_id_new_hp(char tags[NR_TAGS][BUFLEN], int n,
                            struct ink_level *level) {
   char *s = tags[n];
   int length = 0;
+  int version;
+  const struct hp_layout *layout;
+  const struct hp_tail *tail;
   int colors = 0;
-  char colorsAscii[2];
   int i = 0;
   int j = 0;
   int k = 0;
   int colorType = 0;
-  char colorTypeAscii[3];
+  int rawColorType;
   int colorValue = 0;
-  char colorValueAscii[3];
   int colorTypeIndex;
-  int offset;
-  char black[3];
-  char cyan[3];
-  char magenta[3];
-  char yellow[3];
+  unsigned char nibbles[BUFLEN];
 
   /* Determine the length of the string */
 
@@ -47,222 +96,94 @@ int parse_device_id_new_hp(char tags[NR_TAGS][BUFLEN], int n,
 
   s = tags[n];
 
-  if (length > 3 && s[2] == '0' && s[3] == '3') {
-    
-#ifdef DEBUG
-    printf("Version 3 detected\n");
-#endif
-    
-    offset = 20;
-
-  } else if (length > 3 && s[2] == '0' && (s[3] == '0' || s[3] == '1')) {
+  /* All numbers in the tag are hex, decode it at once */
 
-#ifdef DEBUG
-    printf("Version 0 or 1 detected\n");
-#endif
+  decode_nibbles(s, length, nibbles);
 
-      offset = 18;
-
-  } else if (length > 3 && s[2] == '0' && s[3] == '4') {
+  if (length < 4 || !isxdigit((unsigned char) s[2]) || 
+      !isxdigit((unsigned char) s[3]) || 
+      (version = HEX_BYTE(nibbles, 2)) >= HP_LAYOUT_COUNT ||
+      hp_layouts[version].kind == 0) {
 
 #ifdef DEBUG
-    printf("Version 0 or 1 detected\n");
+    printf("Printer not supported\n");
 #endif
 
-      offset = 24;
+    return PRINTER_NOT_SUPPORTED;
+  }
 
-  } else if (length > 3 && s[2] == '0' && s[3] == '2') {
+  layout = &hp_layouts[version];
 
 #ifdef DEBUG
-    printf("Version 2 detected\n");
+  printf("Version %d detected\n", version);
 #endif
 
-    // Do not know if this is alsways correct
-    // Worked at least in the old version
-
-    yellow[0] = s[length - 2];
-    yellow[1] = s[length - 1];
-    yellow[2] = '\0';
-
-    magenta[0] = s[length - 6];
-    magenta[1] = s[length - 5];
-    magenta[2] = '\0';
-
-    cyan[0] = s[length - 10];
-    cyan[1] = s[length - 9];
-    cyan[2] = '\0';
-
-    black[0] = s[length - 14];
-    black[1] = s[length - 13];
-    black[2] = '\0';
+  if (layout->kind == HP_LAYOUT_TAIL) {
+    for (tail = layout->tail; 
+         tail < layout->tail + HP_TAIL_MAX && tail->type != 0; tail++) {
+      if (tail->position > length) {
+        return PRINTER_NOT_SUPPORTED;
+      }
+    }
 
-    level->status = RESPONSE_VALID;
-    level->levels[0][INDEX_TYPE] = CARTRIDGE_BLACK;
-    level->levels[0][INDEX_LEVEL] = my_axtoi(black);
-    level->levels[1][INDEX_TYPE] = CARTRIDGE_CYAN;
-    level->levels[1][INDEX_LEVEL] = my_axtoi(cyan);
-    level->levels[2][INDEX_TYPE] = CARTRIDGE_MAGENTA;
-    level->levels[2][INDEX_LEVEL] = my_axtoi(magenta);
-    level->levels[3][INDEX_TYPE] = CARTRIDGE_YELLOW;
-    level->levels[3][INDEX_LEVEL] = my_axtoi(yellow);
+    for (tail = layout->tail; 
+         tail < layout->tail + HP_TAIL_MAX && tail->type != 0; tail++) {
+      level->status = RESPONSE_VALID;
+      level->levels[k][INDEX_TYPE] = tail->type;
+      level->levels[k][INDEX_LEVEL] = HEX_BYTE(nibbles, 
+                                               length - tail->position);
 
 #ifdef DEBUG
-    printf("Yellow: %d%%, Magenta: %d%%, Cyan: %d%%, Black: %d%%\n",
-           my_axtoi(yellow), my_axtoi(magenta), my_axtoi(cyan), 
-           my_axtoi(black));
+      printf("Type %d: %d%%\n", tail->type, level->levels[k][INDEX_LEVEL]);
 #endif
 
-    return OK;
-
-  } else {
-
-#ifdef DEBUG
-    printf("Printer not supported\n");
-#endif
+      k++;
+    }
 
-    return PRINTER_NOT_SUPPORTED;
+    return OK;
   }
 
-  colorsAscii[0] = s[offset];
-  colorsAscii[1] = '\0';
-
-  colors = atoi(colorsAscii);
+  colors = decode_decimal_digits(s + layout->offset, 1);
 
 #ifdef DEBUG
   printf("Number of colors: %d\n", colors);
 #endif
 
   i = 0; /* current color */
-  j = offset; /* index in device id */
+  j = layout->offset; /* index in device id */
   k = 0; /* index in struct ink_level->levels */
 
-  while ((j+8 < length) && (i < colors)) {
+  while ((j + HP_RECORD_SIZE < length) && (i < colors)) {
 
 #ifdef DEBUG
     printf("Processing color number %d\n", i);
 #endif
       
-    colorTypeAscii[0] = s[j+1];
-    colorTypeAscii[1] = s[j+2];
-    colorTypeAscii[2] = '\0';
-    colorType = my_axtoi(colorTypeAscii) & 0x3f ;
+    rawColorType = HEX_BYTE(nibbles, j + HP_RECORD_TYPE);
+    colorType = rawColorType & HP_TYPE_MASK;
 
 #ifdef DEBUG
-    printf("Raw Color Type: %d\n", my_axtoi(colorTypeAscii));
+    printf("Raw Color Type: %d\n", rawColorType);
 #endif
 
     /* Only show inks with their own head */
     /* Not sure if this is the right approach */
     /* Is needed for Photosmart 8250 to get rid of bogus entry */
       
-    if (my_axtoi(colorTypeAscii) & 0x40) { 
+    if (rawColorType & HP_TYPE_OWN_HEAD) { 
       
 #ifdef DEBUG
       printf("Color type: %d\n", colorType);
 #endif
 
-      colorValueAscii[0] = s[j+7];
-      colorValueAscii[1] = s[j+8];
-      colorValueAscii[2] = '\0';
-      colorValue = my_axtoi(colorValueAscii);
+      colorValue = HEX_BYTE(nibbles, j + HP_RECORD_VALUE);
 
 #ifdef DEBUG
       printf("Color value: %d\n", colorValue);
 #endif
 
-      switch (colorType) {
-      case 0:
-        colorTypeIndex = CARTRIDGE_NOT_PRESENT;
-        break;
-
-      case 1:
-        colorTypeIndex = CARTRIDGE_BLACK;
-        break;
-
-      case 2:
-        colorTypeIndex = CARTRIDGE_COLOR;
-        break;
-
-      case 3:
-        colorTypeIndex = CARTRIDGE_KCM;
-        break;
-
-      case 4:
-        colorTypeIndex = CARTRIDGE_CYAN;
-        break;
-
-      case 5:
-        colorTypeIndex = CARTRIDGE_MAGENTA;
-        break;
-
-      case 6:
-        colorTypeIndex = CARTRIDGE_YELLOW;
-        break;
-
-      case 7:
-        colorTypeIndex = CARTRIDGE_PHOTOCYAN;
-        break;
-
-      case 8:
-        colorTypeIndex = CARTRIDGE_PHOTOMAGENTA;
-        break;
-
-      case 9:
-        colorTypeIndex = CARTRIDGE_PHOTOYELLOW;
-        break;
-
-      case 10:
-        colorTypeIndex = CARTRIDGE_GGK;
-        break;
-
-      case 11:
-        colorTypeIndex = CARTRIDGE_BLUE;
-        break;
-
-      case 12:
-        colorTypeIndex = CARTRIDGE_KCMY;
-        break;
-
-      case 13:
-        colorTypeIndex = CARTRIDGE_LCLM;
-        break;
-
-      case 14:
-        colorTypeIndex = CARTRIDGE_YM;
-        break;
-
-      case 15:
-        colorTypeIndex = CARTRIDGE_CK;
-        break;
-
-      case 16:
-        colorTypeIndex = CARTRIDGE_LGPK;
-        break;
-
-      case 17:
-        colorTypeIndex = CARTRIDGE_LG;
-        break;
-
-      case 18:
-        colorTypeIndex = CARTRIDGE_G;
-        break;
-
-      case 19:
-        colorTypeIndex = CARTRIDGE_PG;
-        break;
-
-      case 32:
-        colorTypeIndex = CARTRIDGE_WHITE;
-        break;
-        
-      case 33:
-        colorTypeIndex = CARTRIDGE_RED;
-        break;
-
-      default:
-        colorTypeIndex = CARTRIDGE_UNKNOWN;
-        break;
-      }
+      colorTypeIndex = ((hp_colors_known >> colorType) & 1) ? 
+        hp_colors[colorType] : CARTRIDGE_UNKNOWN;
 
       if (colorTypeIndex != CARTRIDGE_NOT_PRESENT) {
         level->status = RESPONSE_VALID;
@@ -277,7 +198,7 @@ int parse_device_id_new_hp(char tags[NR_TAGS][BUFLEN], int n,
       }
     }
 
-    j += 8;
+    j += HP_RECORD_SIZE;
     i++;
   }
 
@@ -292,8 +213,6 @@ int parse_device_id_old_hp(char tags[NR_TAGS][BUFLEN], int n,
                            struct ink_level *level) {
   char *s = tags[n];
   int length = 0;
-  char b[4]; /* level of black ink as decimal string */
-  char c[4]; /* level of color ink as decimal string */
   int i;
   int j;
 
@@ -315,17 +234,13 @@ int parse_device_id_old_hp(char tags[NR_TAGS][BUFLEN], int n,
         && s[i+3] == ',') {
 
       if ((s[length - 11] == 'K') && (s[length - 10] == 'P')) {
-        b[0] = s[length - 9];
-        b[1] = s[length - 8];
-        b[2] = s[length - 7];
-        b[3] = '\0';
-        
         level->status = RESPONSE_VALID;
         level->levels[j][INDEX_TYPE] = CARTRIDGE_BLACK;
-        level->levels[j][INDEX_LEVEL] = my_atoi(b);
+        level->levels[j][INDEX_LEVEL] = decode_decimal_digits(s + length - 9, 
+                                                              3);
 
 #ifdef DEBUG
-        printf("Black: %d\n", my_atoi(b));
+        printf("Black: %d\n", level->levels[j][INDEX_LEVEL]);
 #endif
         
         j++;
@@ -343,17 +258,13 @@ int parse_device_id_old_hp(char tags[NR_TAGS][BUFLEN], int n,
         && s[i+3] == ',') {
 
       if ((s[length - 5] == 'C') && (s[length - 4] == 'P')) {
-        c[0] = s[length - 3];
-        c[1] = s[length - 2];
-        c[2] = s[length - 1];
-        c[3] = '\0';
-        
         level->status = RESPONSE_VALID;
         level->levels[j][INDEX_TYPE] = CARTRIDGE_COLOR;
-        level->levels[j][INDEX_LEVEL] = my_atoi(c);
+        level->levels[j][INDEX_LEVEL] = decode_decimal_digits(s + length - 3,
+                                                              3);
         
 #ifdef DEBUG
-        printf("Color: %d\n", my_atoi(c));
+        printf("Color: %d\n", level->levels[j][INDEX_LEVEL]);
 #endif
         j++;
       }
@@ -0,0 +1,542 @@
+/* exporter.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+/* Prometheus exporter mode of ink. A poller thread queries the printers
+ * on a fixed interval and renders the metrics into one of three buffers
+ * allocated at startup. Scrapes are answered from the last complete
+ * buffer, so they neither allocate nor touch the printers.
+ */
+
+#include "config.h"
+
+#include <inklevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ink.h"
+
+#define MAX_PRINTERS 256
+#define SPEC_LENGTH 128
+
+/* Enough for the metrics of one printer with all cartridges */
+
+#define PRINTER_METRICS_SIZE \
+  ((MAX_CARTRIDGE_TYPES + LATENCY_BUCKETS + 16) * 320)
+#define HEADER_METRICS_SIZE 1024
+
+#define SEND_TIMEOUT 2 /* seconds */
+
+/* Upper bounds of the latency histogram in microseconds. They are summed
+ * up from the finer buckets of the library, so they are off by as much as
+ * those are wide.
+ */
+
+#define LATENCY_BUCKETS 12
+
+static const unsigned long long latency_bounds[LATENCY_BUCKETS] = {
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+  2500000, 5000000
+};
+
+struct exported_printer {
+  int port;
+  const char *device_file;
+  int portnumber;
+  char spec[SPEC_LENGTH]; /* printer label */
+  struct ink_session *session;
+  int result;              /* of the last query */
+  double duration;         /* of the last query, in seconds */
+  time_t queried;
+  struct ink_level level;
+  struct ink_stats stats;  /* of the session */
+};
+
+struct metrics {
+  char *text;
+  size_t length;
+  size_t size;
+};
+
+static struct exported_printer printers[MAX_PRINTERS];
+static int printer_count = 0;
+static int poll_interval;
+
+/* front is the last complete buffer, serving the one a scrape is being
+ * sent from. The poller renders into the third, so the lock is only held
+ * to pick buffers, never while sending or rendering.
+ */
+
+static struct metrics buffers[3];
+static struct metrics *front = &buffers[0];
+static struct metrics *serving = NULL;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char not_found[] =
+  "HTTP/1.0 404 Not Found\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 10\r\n\r\n"
+  "Not found\n";
+
+/* local functions */
+
+static int add_printer(const char *spec, const int port,
+                       const char *device_file, const int portnumber);
+static void *poller(void *arg);
+static void query_printer(struct exported_printer *p);
+static void render(struct metrics *m);
+static void render_levels(struct metrics *m, struct exported_printer *p);
+static void render_counter(struct metrics *m, const char *name,
+                           const char *help, const size_t offset);
+static void render_latency(struct metrics *m, struct exported_printer *p);
+static void append(struct metrics *m, const char *format, ...);
+static void append_label(struct metrics *m, const char *value, size_t length);
+static int open_http_socket(const int http_port);
+static void serve_scrape(const int fd);
+static int send_all(const int fd, const char *data, size_t length);
+
+int run_exporter(const int http_port, const int interval, const int count,
+                 char *specs[], const int port, const char *device_file,
+                 const int portnumber) {
+  pthread_t thread;
+  size_t size;
+  int listen_fd;
+  int fd;
+  int i;
+
+  poll_interval = interval;
+  set_ink_stats(1);
+
+  if (count == 0) {
+    if (port == 0) {
+      printf("No printer given.\n");
+      return 1;
+    }
+
+    if (add_printer(NULL, port, device_file, portnumber) != 0) {
+      return 1;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (add_printer(specs[i], 0, NULL, 0) != 0) {
+      return 1;
+    }
+  }
+
+  size = HEADER_METRICS_SIZE + printer_count * PRINTER_METRICS_SIZE;
+
+  for (i = 0; i < 3; i++) {
+    if ((buffers[i].text = malloc(size)) == NULL) {
+      printf("Not enough memory available.\n");
+      return 1;
+    }
+    buffers[i].size = size;
+    buffers[i].length = 0;
+  }
+
+  if ((listen_fd = open_http_socket(http_port)) < 0) {
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pthread_create(&thread, NULL, poller, NULL) != 0) {
+    printf("Could not start the poller.\n");
+    return 1;
+  }
+
+  while (1) {
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      perror("accept");
+      return 1;
+    }
+
+    serve_scrape(fd);
+    close(fd);
+  }
+
+  return 0;
+}
+
+static int add_printer(const char *spec, const int port,
+                       const char *device_file, const int portnumber) {
+  struct exported_printer *p;
+  const char *number;
+  size_t length;
+
+  if (printer_count >= MAX_PRINTERS) {
+    printf("Too many printers, at most %d.\n", MAX_PRINTERS);
+    return 1;
+  }
+
+  p = &printers[printer_count];
+  memset(p, 0, sizeof(struct exported_printer));
+
+  if (spec == NULL) {
+    p->port = port;
+    p->device_file = device_file;
+    p->portnumber = portnumber;
+
+    if (port == CUSTOM_USB || port == CUSTOM_BJNP) {
+      snprintf(p->spec, SPEC_LENGTH, "%s", device_file);
+    } else {
+      snprintf(p->spec, SPEC_LENGTH, "%s:%d", port == USB ? "usb" :
+               port == PARPORT ? "parport" : "bjnp", portnumber);
+    }
+  } else {
+    snprintf(p->spec, SPEC_LENGTH, "%s", spec);
+
+    if (spec[0] == '/') {
+      p->port = CUSTOM_USB;
+      p->device_file = spec;
+    } else if (strncmp(spec, "bjnp://", 7) == 0) {
+      p->port = CUSTOM_BJNP;
+      p->device_file = spec;
+    } else {
+      number = strchr(spec, ':');
+      length = number ? (size_t) (number - spec) : strlen(spec);
+
+      if (length == 3 && strncmp(spec, "usb", 3) == 0) {
+        p->port = USB;
+      } else if (length == 7 && strncmp(spec, "parport", 7) == 0) {
+        p->port = PARPORT;
+      } else if (length == 4 && strncmp(spec, "bjnp", 4) == 0) {
+        p->port = BJNP;
+      } else {
+        printf("Unknown printer '%s'.\n", spec);
+        return 1;
+      }
+
+      if (number != NULL) {
+        p->portnumber = atoi(number + 1);
+      }
+    }
+  }
+
+  if ((p->session = ink_session_new(p->port, p->device_file,
+                                    p->portnumber)) == NULL) {
+    printf("Not enough memory available.\n");
+    return 1;
+  }
+
+  printer_count++;
+
+  return 0;
+}
+
+static void *poller(void *arg) {
+  struct metrics *m;
+  int i;
+
+  (void) arg;
+
+  while (1) {
+    for (i = 0; i < printer_count; i++) {
+      query_printer(&printers[i]);
+    }
+
+    pthread_mutex_lock(&buffer_lock);
+    for (i = 0; &buffers[i] == front || &buffers[i] == serving; i++) {
+    }
+    m = &buffers[i];
+    pthread_mutex_unlock(&buffer_lock);
+
+    render(m);
+
+    pthread_mutex_lock(&buffer_lock);
+    front = m;
+    pthread_mutex_unlock(&buffer_lock);
+
+    sleep(poll_interval);
+  }
+
+  return NULL;
+}
+
+static void query_printer(struct exported_printer *p) {
+  struct timespec start;
+  struct timespec end;
+  int unchanged;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  p->result = ink_session_get_ink_level(p->session, &p->level, &unchanged);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  p->duration = (end.tv_sec - start.tv_sec) +
+    (end.tv_nsec - start.tv_nsec) / 1e9;
+  p->queried = time(NULL);
+  ink_session_get_stats(p->session, &p->stats);
+}
+
+/* The samples of a metric have to be together, so there is one pass over
+ * the printers per metric
+ */
+
+static void render(struct metrics *m) {
+  struct exported_printer *p;
+
+  m->length = 0;
+
+  append(m, "# HELP ink_level Ink level in percent.\n"
+         "# TYPE ink_level gauge\n");
+  for (p = printers; p < printers + printer_count; p++) {
+    render_levels(m, p);
+  }
+
+  append(m, "# HELP ink_query_result Result of the last query, 0 is OK.\n"
+         "# TYPE ink_query_result gauge\n");
+  for (p = printers; p < printers + printer_count; p++) {
+    append(m, "ink_query_result{printer=\"");
+    append_label(m, p->spec, strlen(p->spec));
+    append(m, "\"} %d\n", p->result);
+  }
+
+  append(m, "# HELP ink_query_duration_seconds Duration of the last query.\n"
+         "# TYPE ink_query_duration_seconds gauge\n");
+  for (p = printers; p < printers + printer_count; p++) {
+    append(m, "ink_query_duration_seconds{printer=\"");
+    append_label(m, p->spec, strlen(p->spec));
+    append(m, "\"} %.6f\n", p->duration);
+  }
+
+  append(m, "# HELP ink_query_timestamp_seconds Time of the last query.\n"
+         "# TYPE ink_query_timestamp_seconds gauge\n");
+  for (p = printers; p < printers + printer_count; p++) {
+    append(m, "ink_query_timestamp_seconds{printer=\"");
+    append_label(m, p->spec, strlen(p->spec));
+    append(m, "\"} %ld\n", (long) p->queried);
+  }
+
+  render_counter(m, "ink_queries_total", "Queries of the printer.",
+                 offsetof(struct ink_stats, queries));
+  render_counter(m, "ink_query_errors_total", "Queries that failed.",
+                 offsetof(struct ink_stats, errors));
+  render_counter(m, "ink_protocol_errors_total", 
+                 "Replies that could not be parsed.",
+                 offsetof(struct ink_stats, protocol_errors));
+  render_counter(m, "ink_timeouts_total", "Reads that timed out.",
+                 offsetof(struct ink_stats, timeouts));
+  render_counter(m, "ink_retries_total", "Commands sent again.",
+                 offsetof(struct ink_stats, retries));
+  render_counter(m, "ink_reopens_total", "Devices opened again.",
+                 offsetof(struct ink_stats, reopens));
+
+  append(m, "# HELP ink_query_latency_seconds Latency of the queries.\n"
+         "# TYPE ink_query_latency_seconds histogram\n");
+  for (p = printers; p < printers + printer_count; p++) {
+    render_latency(m, p);
+  }
+}
+
+static void render_counter(struct metrics *m, const char *name,
+                           const char *help, const size_t offset) {
+  struct exported_printer *p;
+
+  append(m, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (p = printers; p < printers + printer_count; p++) {
+    append(m, "%s{printer=\"", name);
+    append_label(m, p->spec, strlen(p->spec));
+    append(m, "\"} %llu\n", 
+           *(unsigned long long *) ((char *) &p->stats + offset));
+  }
+}
+
+static void render_latency(struct metrics *m, struct exported_printer *p) {
+  unsigned long long count = 0;
+  int bucket = 0;
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    for (; bucket < INK_STATS_BUCKETS && 
+           ink_stats_bucket_limit(bucket) < latency_bounds[i]; bucket++) {
+      count += p->stats.latency[bucket];
+    }
+
+    append(m, "ink_query_latency_seconds_bucket{printer=\"");
+    append_label(m, p->spec, strlen(p->spec));
+    append(m, "\",le=\"%g\"} %llu\n", latency_bounds[i] / 1e6, count);
+  }
+
+  append(m, "ink_query_latency_seconds_bucket{printer=\"");
+  append_label(m, p->spec, strlen(p->spec));
+  append(m, "\",le=\"+Inf\"} %llu\n", p->stats.queries);
+  append(m, "ink_query_latency_seconds_sum{printer=\"");
+  append_label(m, p->spec, strlen(p->spec));
+  append(m, "\"} %.6f\n", p->stats.latency_sum_us / 1e6);
+  append(m, "ink_query_latency_seconds_count{printer=\"");
+  append_label(m, p->spec, strlen(p->spec));
+  append(m, "\"} %llu\n", p->stats.queries);
+}
+
+static void render_levels(struct metrics *m, struct exported_printer *p) {
+  const struct ink_level *level = &p->level;
+  const char *name;
+  int i;
+
+  if (p->result != OK || level->status != RESPONSE_VALID) {
+    return;
+  }
+
+  for (i = 0; i < MAX_CARTRIDGE_TYPES &&
+         level->levels[i][INDEX_TYPE] != CARTRIDGE_NOT_PRESENT; i++) {
+    name = level->levels[i][INDEX_TYPE] < MAX_CARTRIDGE_TYPES &&
+      strCartridges[level->levels[i][INDEX_TYPE]] != NULL ?
+      strCartridges[level->levels[i][INDEX_TYPE]] : "Unknown:";
+
+    append(m, "ink_level{printer=\"");
+    append_label(m, p->spec, strlen(p->spec));
+    append(m, "\",model=\"");
+    append_label(m, level->model, strnlen(level->model, MODEL_NAME_LENGTH));
+    append(m, "\",cartridge=\"");
+    append_label(m, name, strlen(name) - 1); /* without the ':' */
+    append(m, "\"} %d\n", level->levels[i][INDEX_LEVEL]);
+  }
+}
+
+/* Output that does not fit is dropped, the buffers are sized so that
+ * this does not happen
+ */
+
+static void append(struct metrics *m, const char *format, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, format);
+  n = vsnprintf(m->text + m->length, m->size - m->length, format, ap);
+  va_end(ap);
+
+  if (n > 0) {
+    m->length += ((size_t) n < m->size - m->length) ?
+      (size_t) n : m->size - m->length - 1;
+  }
+}
+
+static void append_label(struct metrics *m, const char *value,
+                         size_t length) {
+  size_t i;
+
+  for (i = 0; i < length && m->length + 2 < m->size; i++) {
+    if (value[i] == '\\' || value[i] == '"') {
+      m->text[m->length++] = '\\';
+      m->text[m->length++] = value[i];
+    } else if (value[i] == '\n') {
+      m->text[m->length++] = '\\';
+      m->text[m->length++] = 'n';
+    } else {
+      m->text[m->length++] = value[i];
+    }
+  }
+
+  m->text[m->length] = '\0';
+}
+
+static int open_http_socket(const int http_port) {
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(http_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void serve_scrape(const int fd) {
+  struct timeval timeout = { SEND_TIMEOUT, 0 };
+  char request[1024];
+  char header[128];
+  const char *text;
+  size_t text_length;
+  ssize_t n;
+  int length;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  /* the request line is all that matters */
+
+  if ((n = recv(fd, request, sizeof(request) - 1, 0)) <= 0) {
+    return;
+  }
+  request[n] = '\0';
+
+  if (strncmp(request, "GET /metrics ", 13) != 0 &&
+      strncmp(request, "GET /metrics?", 13) != 0) {
+    send_all(fd, not_found, sizeof(not_found) - 1);
+    return;
+  }
+
+  pthread_mutex_lock(&buffer_lock);
+  serving = front;
+  text = front->text;
+  text_length = front->length;
+  pthread_mutex_unlock(&buffer_lock);
+
+  length = snprintf(header, sizeof(header),
+                    "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %lu\r\n\r\n",
+                    (unsigned long) text_length);
+
+  if (send_all(fd, header, length) == 0) {
+    send_all(fd, text, text_length);
+  }
+
+  pthread_mutex_lock(&buffer_lock);
+  serving = NULL;
+  pthread_mutex_unlock(&buffer_lock);
+}
+
+static int send_all(const int fd, const char *data, size_t length) {
+  ssize_t n;
+
+  while (length > 0) {
+    if ((n = send(fd, data, length, MSG_NOSIGNAL)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    length -= n;
+  }
+
+  return 0;
+}
@@ -23,6 +23,43 @@
 #include <string.h>
 #include <sys/ioctl.h>
 
+#include "ink.h"
+
+const char *strCartridges[MAX_CARTRIDGE_TYPES] = {
+  "Not present:",
+  "Black:",
+  "Color:",
+  "Photo:",
+  "Cyan:",
+  "Magenta:",
+  "Yellow:",
+  "Photoblack:",
+  "Photocyan:",
+  "Photomagenta:",
+  "Photoyellow:",
+  "Red:",
+  "Green:",
+  "Blue:",
+  "Light Black:",
+  "Light Cyan:",
+  "Light Magenta:",
+  "Light Light Black:",
+  "Matte Black:",
+  "Gloss Optimizer:",
+  "Unknown:",
+  "Black, Cyan, Magenta:",
+  "2x Grey and Black:",
+  "Black, Cyan, Magenta, Yellow:",
+  "Photocyan and Photomagenta:",
+  "Yellow and Magenta:",
+  "Cyan and Black:",
+  "Light Grey and Photoblack:",
+  "Light Grey:",
+  "Medium Grey:",
+  "Photogrey:",
+  "White:"
+};
+
 void usage(void) {
   printf("ink -p \"usb\"|\"parport\" [-n <portnumber>] [-t <threshold>] | -d <device_file>\n");
   printf("ink -p \"bjnp\" | -b \"bjnp://<printer.my.domain>\" | -v\n\n");
@@ -37,6 +74,9 @@ void usage(void) {
   printf("'ink -b bjnp://111.222.111.222' Query bjnp network printer on ip-address 111.222.111.222\n");
   printf("'ink -p usb -t 20' Only print ink levels less than or equal to 20%%\n");
   printf("'ink -v' Show version information\n");
+  printf("'ink -e 9101 usb usb:1 bjnp://printer.my.domain' Serve the ink levels of\n");
+  printf("  the listed printers as Prometheus metrics on http://localhost:9101/metrics,\n");
+  printf("  querying them every 60 seconds or as given by -i <seconds>\n");
 }
 
 void print_version_information(void) {
@@ -49,6 +89,117 @@ void print_version_information(void) {
   printf("\n");
 }
 
+void print_error(const int result, const int portnumber,
+                 const char *devicefile) {
+  switch (result) {
+  case ERROR:
+    printf("An unknown error occured.\n");
+    break;
+  case DEV_PARPORT_INACCESSIBLE:
+    printf("Could not access '/dev/parport%d'.\n", portnumber);
+    break;
+  case DEV_LP_INACCESSIBLE:
+    printf("Could not access '/dev/lp%d'.\n", portnumber);
+    break;
+  case COULD_NOT_GET_DEVICE_ID:
+    printf("Could not get device id.\n");
+    break;
+  case DEV_USB_LP_INACCESSIBLE:
+    printf("Could not access '/dev/usb/lp%d' or '/dev/usblp%d'.\n", 
+           portnumber, portnumber);
+    break;
+  case UNKNOWN_PORT_SPECIFIED:
+    printf("Unknown port specified.\n");
+    break;
+  case NO_PRINTER_FOUND:
+    printf("No printer found.\n");
+    break;
+  case NO_DEVICE_CLASS_FOUND:
+    printf("No device class found.\n");
+    break;
+  case NO_CMD_TAG_FOUND:
+    printf("No cmd tag found.\n");
+    break;
+  case PRINTER_NOT_SUPPORTED:
+    printf("Printer not supported.\n");
+    break;
+  case NO_INK_LEVEL_FOUND:
+    printf("No ink level found.\n");
+    break;
+  case COULD_NOT_WRITE_TO_PRINTER:
+    printf("Could not write to printer.\n");
+    break;
+  case COULD_NOT_READ_FROM_PRINTER:
+    printf("Could not read from printer.\n");
+    break;
+  case COULD_NOT_PARSE_RESPONSE_FROM_PRINTER:
+    printf("Could not parse response from printer.\n");
+    break;
+  case COULD_NOT_GET_CREDIT:
+    printf("Could not get credit.\n");
+    break;
+  case DEV_CUSTOM_USB_INACCESSIBLE:
+    printf("Could not access custom usb device '%s'.\n", devicefile);
+    break;
+  case BJNP_URI_INVALID:
+    printf("Printer URI is invalid: '%s'.\n", devicefile);
+    break;
+  case BJNP_INVALID_HOSTNAME:
+    printf("Could not open hostname: '%s'.\n", devicefile);
+    break;
+  }
+
+  printf("Could not get ink level.\n");
+}
+
+/* With a threshold the levels are read by a session, whose first query
+ * reports every cartridge at or below the threshold as an event.
+ */
+
+int print_low_levels(const int port, const char *devicefile,
+                     const int portnumber, const int threshold,
+                     const char *headerline) {
+  struct ink_session *session;
+  struct ink_event_queue *queue;
+  struct ink_event event;
+  struct ink_level level;
+  int unchanged;
+  int result;
+
+  session = ink_session_new(port, devicefile, portnumber);
+  queue = ink_event_queue_new(MAX_CARTRIDGE_TYPES);
+
+  if (session == NULL || queue == NULL) {
+    printf("Not enough memory available.\n");
+    ink_session_free(session);
+    ink_event_queue_free(queue);
+    return 1;
+  }
+
+  ink_session_set_threshold(session, INK_ALL_CARTRIDGES, threshold, 0);
+  ink_session_set_event_queue(session, queue);
+
+  result = ink_session_get_ink_level(session, &level, &unchanged);
+
+  if (result != OK) {
+    print_error(result, portnumber, devicefile);
+  } else if (level.status != RESPONSE_VALID) {
+    printf("No ink level found\n");
+  } else if (ink_event_queue_get(queue, &event)) {
+    printf("%s", headerline);
+    printf("%s\n\n", level.model);
+
+    do {
+      printf("%-29s %3d%%\n", strCartridges[event.type], event.level);
+    } while (ink_event_queue_get(queue, &event));
+  }
+
+  ink_session_free(session);
+  ink_event_queue_free(queue);
+
+  return result == OK ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
   struct ink_level *level = NULL;
   int result = 0;
@@ -60,41 +211,8 @@ int main(int argc, char *argv[]) {
   int headerNeeded = 1;
   char headerline[80] = "";
   char *devicefile = ""; 
-
-  char *strCartridges[MAX_CARTRIDGE_TYPES] = {
-    "Not present:",
-    "Black:",
-    "Color:",
-    "Photo:",
-    "Cyan:",
-    "Magenta:",
-    "Yellow:",
-    "Photoblack:",
-    "Photocyan:",
-    "Photomagenta:",
-    "Photoyellow:",
-    "Red:",
-    "Green:",
-    "Blue:",
-    "Light Black:",
-    "Light Cyan:",
-    "Light Magenta:",
-    "Light Light Black:",
-    "Matte Black:",
-    "Gloss Optimizer:",
-    "Unknown:",
-    "Black, Cyan, Magenta:",
-    "2x Grey and Black:",
-    "Black, Cyan, Magenta, Yellow:",
-    "Photocyan and Photomagenta:",
-    "Yellow and Magenta:",
-    "Cyan and Black:",
-    "Light Grey and Photoblack:",
-    "Light Grey:",
-    "Medium Grey:",
-    "Photogrey:",
-    "White:"
-  };
+  int exporter_port = 0;
+  int interval = 60;
 
   strcat(headerline, PACKAGE_STRING);
   strcat(headerline, " (c) 2010 Markus Heinz\n\n");
@@ -104,7 +222,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  while ((c = getopt(argc, argv, "b:p:n:t:d:v")) != -1) {
+  while ((c = getopt(argc, argv, "b:p:n:t:d:e:i:v")) != -1) {
     switch (c) {
     case 'p':
       if (strcmp(optarg, "parport") == 0) {
@@ -153,6 +271,20 @@ int main(int argc, char *argv[]) {
 	return 1;
       }
       break;
+    case 'e':
+      exporter_port = atoi(optarg);
+      if (exporter_port <= 0 || exporter_port > 65535) {
+	usage();
+	return 1;
+      }
+      break;
+    case 'i':
+      interval = atoi(optarg);
+      if (interval <= 0) {
+	usage();
+	return 1;
+      }
+      break;
     case 'v':
       print_version_information();
       return 0;
@@ -163,6 +295,16 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (exporter_port != 0) {
+    return run_exporter(exporter_port, interval, argc - optind, argv + optind,
+			port, devicefile, portnumber);
+  }
+
+  if (threshold != -1) {
+    return print_low_levels(port, devicefile, portnumber, threshold,
+                            headerline);
+  }
+
   level = (struct ink_level *) malloc(sizeof(struct ink_level));
 
   if (level == NULL) {
@@ -179,64 +321,7 @@ int main(int argc, char *argv[]) {
   result = get_ink_level_canon_simple(fd, port, devicefile, portnumber, level);
 
   if (result != OK) {
-    switch (result) {
-    case ERROR:
-      printf("An unknown error occured.\n");
-      break;
-    case DEV_PARPORT_INACCESSIBLE:
-      printf("Could not access '/dev/parport%d'.\n", portnumber);
-      break;
-    case DEV_LP_INACCESSIBLE:
-      printf("Could not access '/dev/lp%d'.\n", portnumber);
-      break;
-    case COULD_NOT_GET_DEVICE_ID:
-      printf("Could not get device id.\n");
-      break;
-    case DEV_USB_LP_INACCESSIBLE:
-      printf("Could not access '/dev/usb/lp%d' or '/dev/usblp%d'.\n", 
-             portnumber, portnumber);
-      break;
-    case UNKNOWN_PORT_SPECIFIED:
-      printf("Unknown port specified.\n");
-      break;
-    case NO_PRINTER_FOUND:
-      printf("No printer found.\n");
-      break;
-    case NO_DEVICE_CLASS_FOUND:
-      printf("No device class found.\n");
-      break;
-    case NO_CMD_TAG_FOUND:
-      printf("No cmd tag found.\n");
-      break;
-    case PRINTER_NOT_SUPPORTED:
-      printf("Printer not supported.\n");
-      break;
-    case NO_INK_LEVEL_FOUND:
-      printf("No ink level found.\n");
-      break;
-    case COULD_NOT_WRITE_TO_PRINTER:
-      printf("Could not write to printer.\n");
-      break;
-    case COULD_NOT_READ_FROM_PRINTER:
-      printf("Could not read from printer.\n");
-      break;
-    case COULD_NOT_PARSE_RESPONSE_FROM_PRINTER:
-      printf("Could not parse response from printer.\n");
-      break;
-    case COULD_NOT_GET_CREDIT:
-      printf("Could not get credit.\n");
-      break;
-    case DEV_CUSTOM_USB_INACCESSIBLE:
-      printf("Could not access custom usb device '%s'.\n", devicefile);
-      break;
-    case BJNP_URI_INVALID:
-      printf("Printer URI is invalid: '%s'.\n", devicefile);
-      break;
-    case BJNP_INVALID_HOSTNAME:
-      printf("Could not open hostname: '%s'.\n", devicefile);
-      break;
-   }
-    printf("Could not get ink level.\n");
+    print_error(result, portnumber, devicefile);
     free(level);
     return 1;
   }
@@ -248,19 +333,17 @@ int main(int argc, char *argv[]) {
 
   case RESPONSE_VALID:
     for(i = 0; i < MAX_CARTRIDGE_TYPES; i++) {
-      if (threshold == -1 || level->levels[i][INDEX_LEVEL] <= threshold) {
-	if (headerNeeded) {
-	  printf("%s", headerline);
-	  printf("%s\n\n", level->model);
-	  headerNeeded = 0;
-	}
-	if(level->levels[i][INDEX_TYPE] != CARTRIDGE_NOT_PRESENT) {
+      if (headerNeeded) {
+	printf("%s", headerline);
+	printf("%s\n\n", level->model);
+	headerNeeded = 0;
+      }
+      if(level->levels[i][INDEX_TYPE] != CARTRIDGE_NOT_PRESENT) {
 
-	  printf("%-29s %3d%%\n", strCartridges[level->levels[i][INDEX_TYPE]],
-		 level->levels[i][INDEX_LEVEL]);
-	} else {
-	  break;
-	}
+	printf("%-29s %3d%%\n", strCartridges[level->levels[i][INDEX_TYPE]],
+	       level->levels[i][INDEX_LEVEL]);
+      } else {
+	break;
       }
     }
     break;
@@ -0,0 +1,24 @@
+/* ink.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef INK_H
+#define INK_H
+
+extern const char *strCartridges[MAX_CARTRIDGE_TYPES];
+
+/* Serves the levels of the printers as Prometheus metrics on
+ * http://localhost:<http_port>/metrics until killed. The printers are given
+ * as "usb[:n]", "parport[:n]", "bjnp[:n]", "bjnp://host" or a device file,
+ * if there are none the one of -p, -n, -d or -b is used.
+ */
+
+int run_exporter(const int http_port, const int interval, const int count,
+                 char *specs[], const int port, const char *device_file,
+                 const int portnumber);
+
+#endif
@@ -0,0 +1,542 @@
+/* inkd.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+/* Queries a set of printers on a schedule and answers clients on a Unix
+ * domain socket from what it got the last time, so that the printers are
+ * only touched by this one process.
+ */
+
+#include "config.h"
+
+#include <inklevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "inkd.h"
+
+#define MAX_PRINTERS 64
+#define MAX_CLIENTS 32
+#define DEFAULT_INTERVAL 60
+
+struct printer {
+  int port;
+  const char *device_file;
+  int portnumber;
+  struct ink_session *session; /* only used by the poller */
+  struct inkd_printer cache;   /* protected by cache_lock */
+  time_t polled;               /* 0 if not yet queried */
+};
+
+static struct printer printers[MAX_PRINTERS];
+static int printer_count = 0;
+static int interval = DEFAULT_INTERVAL;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stopping = 0;
+
+static volatile sig_atomic_t terminate = 0;
+
+static struct inkd_table *table = NULL; /* the shared table, if any */
+static size_t table_size;
+
+/* local functions */
+
+static void usage(void);
+static int add_printer(const char *spec);
+static void *poller(void *arg);
+static void poll_printer(struct printer *p);
+static int open_socket(const char *path);
+static int serve_client(int fd);
+static int open_table(const char *path);
+static void publish(const struct printer *p);
+static void on_signal(int sig);
+
+static void usage(void) {
+  printf("inkd [-s <socket>] [-m <file>] [-i <seconds>] [-f] <printer>...\n\n");
+
+  printf("<printer> is one of\n");
+  printf("  usb[:<portnumber>]      usb port printer\n");
+  printf("  parport[:<portnumber>]  parallel port printer\n");
+  printf("  bjnp[:<portnumber>]     bjnp network printer\n");
+  printf("  bjnp://<host>           bjnp network printer on host\n");
+  printf("  /dev/...                usb printer on a device file\n\n");
+
+  printf("'inkd -i 10 usb usb:1' Query the first two usb printers every 10 seconds\n");
+  printf("-s sets the socket, default %s\n", INKD_SOCKET);
+  printf("-m also publishes the levels in file, e.g. /dev/shm/inkd\n");
+  printf("-f stays in the foreground\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *socket_path = INKD_SOCKET;
+  const char *table_path = NULL;
+  int foreground = 0;
+  struct pollfd fds[MAX_CLIENTS + 1];
+  struct sigaction sa;
+  sigset_t mask;
+  pthread_t thread;
+  int nfds;
+  int listen_fd;
+  int fd;
+  int c;
+  int i;
+
+  while ((c = getopt(argc, argv, "s:m:i:fv")) != -1) {
+    switch (c) {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'm':
+      table_path = optarg;
+      break;
+    case 'i':
+      interval = atoi(optarg);
+      if (interval <= 0) {
+        usage();
+        return 1;
+      }
+      break;
+    case 'f':
+      foreground = 1;
+      break;
+    case 'v':
+      printf("%s\n%s\n", PACKAGE_STRING, get_version_string());
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+
+  for (i = optind; i < argc; i++) {
+    if (add_printer(argv[i]) != 0) {
+      return 1;
+    }
+  }
+
+  if (table_path != NULL && open_table(table_path) != 0) {
+    return 1;
+  }
+
+  if ((listen_fd = open_socket(socket_path)) < 0) {
+    return 1;
+  }
+
+  if (!foreground && daemon(0, 0) != 0) {
+    perror("daemon");
+    unlink(socket_path);
+    return 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal; /* no SA_RESTART, so poll() is interrupted */
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  /* the signals are to interrupt the poll() below, not the poller */
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  if (pthread_create(&thread, NULL, poller, NULL) != 0) {
+    fprintf(stderr, "Could not start the poller\n");
+    unlink(socket_path);
+    return 1;
+  }
+
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+  fds[0].fd = listen_fd;
+  fds[0].events = POLLIN;
+  nfds = 1;
+
+  while (!terminate) {
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    /* answer clients, drop the ones that closed or sent garbage */
+
+    for (i = nfds - 1; i > 0; i--) {
+      if (fds[i].revents != 0 && serve_client(fds[i].fd) != 0) {
+        close(fds[i].fd);
+        fds[i] = fds[--nfds];
+      }
+    }
+
+    /* clients are non-blocking, one that does not read its replies is
+       dropped instead of stalling everyone else */
+
+    if (fds[0].revents & POLLIN) {
+      if ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (nfds <= MAX_CLIENTS && fcntl(fd, F_SETFL, O_NONBLOCK) == 0) {
+          fds[nfds].fd = fd;
+          fds[nfds].events = POLLIN;
+          fds[nfds].revents = 0;
+          nfds++;
+        } else {
+          close(fd);
+        }
+      }
+    }
+  }
+
+  pthread_mutex_lock(&stop_lock);
+  stopping = 1;
+  pthread_cond_signal(&stop_cond);
+  pthread_mutex_unlock(&stop_lock);
+  pthread_join(thread, NULL);
+
+  for (i = 1; i < nfds; i++) {
+    close(fds[i].fd);
+  }
+  close(listen_fd);
+  unlink(socket_path);
+
+  for (i = 0; i < printer_count; i++) {
+    ink_session_free(printers[i].session);
+  }
+
+  if (table != NULL) {
+    munmap(table, table_size);
+  }
+
+  return 0;
+}
+
+static int add_printer(const char *spec) {
+  struct printer *p;
+  const char *number;
+  size_t length;
+
+  if (printer_count >= MAX_PRINTERS) {
+    fprintf(stderr, "Too many printers, at most %d\n", MAX_PRINTERS);
+    return 1;
+  }
+
+  p = &printers[printer_count];
+  memset(p, 0, sizeof(struct printer));
+
+  if (spec[0] == '/') {
+    p->port = CUSTOM_USB;
+    p->device_file = spec;
+  } else if (strncmp(spec, "bjnp://", 7) == 0) {
+    p->port = CUSTOM_BJNP;
+    p->device_file = spec;
+  } else {
+    number = strchr(spec, ':');
+    length = number ? (size_t) (number - spec) : strlen(spec);
+
+    if (length == 3 && strncmp(spec, "usb", 3) == 0) {
+      p->port = USB;
+    } else if (length == 7 && strncmp(spec, "parport", 7) == 0) {
+      p->port = PARPORT;
+    } else if (length == 4 && strncmp(spec, "bjnp", 4) == 0) {
+      p->port = BJNP;
+    } else {
+      fprintf(stderr, "Unknown printer '%s'\n", spec);
+      return 1;
+    }
+
+    if (number != NULL) {
+      p->portnumber = atoi(number + 1);
+    }
+  }
+
+  if ((p->session = ink_session_new(p->port, p->device_file,
+                                    p->portnumber)) == NULL) {
+    fprintf(stderr, "Not enough memory available.\n");
+    return 1;
+  }
+
+  p->cache.index = printer_count;
+  p->cache.result = NO_INK_LEVEL_FOUND;
+  printer_count++;
+
+  return 0;
+}
+
+/* Queries all printers, then sleeps until the next interval or until
+ * the daemon stops
+ */
+
+static void *poller(void *arg) {
+  struct timespec wakeup;
+  int i;
+
+  (void) arg;
+
+  pthread_mutex_lock(&stop_lock);
+
+  while (!stopping) {
+    pthread_mutex_unlock(&stop_lock);
+
+    for (i = 0; i < printer_count; i++) {
+      poll_printer(&printers[i]);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &wakeup);
+    wakeup.tv_sec += interval;
+
+    pthread_mutex_lock(&stop_lock);
+    while (!stopping &&
+           pthread_cond_timedwait(&stop_cond, &stop_lock, &wakeup) == 0) {
+    }
+  }
+
+  pthread_mutex_unlock(&stop_lock);
+
+  return NULL;
+}
+
+static void poll_printer(struct printer *p) {
+  struct ink_level level;
+  struct inkd_printer *cache = &p->cache;
+  int unchanged;
+  int result;
+  int i;
+
+  result = ink_session_get_ink_level(p->session, &level, &unchanged);
+
+  pthread_mutex_lock(&cache_lock);
+
+  p->polled = time(NULL);
+  cache->result = result;
+
+  if (result == OK && !unchanged) {
+    memcpy(cache->model, level.model, MODEL_NAME_LENGTH);
+    cache->model[MODEL_NAME_LENGTH - 1] = '\0';
+    cache->status = level.status;
+    cache->generation++;
+
+    for (i = 0; i < MAX_CARTRIDGE_TYPES &&
+           level.levels[i][INDEX_TYPE] != CARTRIDGE_NOT_PRESENT; i++) {
+      cache->levels[i].type = level.levels[i][INDEX_TYPE];
+      cache->levels[i].level = level.levels[i][INDEX_LEVEL];
+    }
+    cache->num_levels = i;
+  }
+
+  if (table != NULL) {
+    publish(p);
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* The table is built in a new file that is renamed over the old one, so
+ * readers that still have the old file mapped never see it change under
+ * them. Its magic is cleared to tell them to map the file again.
+ */
+
+static int open_table(const char *path) {
+  struct inkd_table *old;
+  char new_path[4096];
+  int fd;
+  int i;
+
+  table_size = sizeof(struct inkd_table) + 
+    printer_count * sizeof(struct inkd_table_slot);
+
+  if (snprintf(new_path, sizeof(new_path), "%s.XXXXXX", path) >=
+      (int) sizeof(new_path) || (fd = mkstemp(new_path)) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  if (fchmod(fd, 0644) != 0 || ftruncate(fd, table_size) != 0 ||
+      (table = mmap(NULL, table_size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+                    fd, 0)) == MAP_FAILED) {
+    perror(new_path);
+    close(fd);
+    unlink(new_path);
+    table = NULL;
+    return 1;
+  }
+
+  close(fd);
+
+  table->version = INKD_VERSION;
+  table->slot_size = sizeof(struct inkd_table_slot);
+  table->slot_count = printer_count;
+
+  for (i = 0; i < printer_count; i++) {
+    memcpy(&table->slots[i].printer, &printers[i].cache, 
+           sizeof(struct inkd_printer));
+  }
+
+  __atomic_store_n(&table->magic, INKD_TABLE_MAGIC, __ATOMIC_RELEASE);
+
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) >= 0) {
+    old = mmap(NULL, sizeof(struct inkd_table), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (old != MAP_FAILED) {
+      __atomic_store_n(&old->magic, 0, __ATOMIC_RELEASE);
+      munmap(old, sizeof(struct inkd_table));
+    }
+    close(fd);
+  }
+
+  if (rename(new_path, path) != 0) {
+    perror(path);
+    unlink(new_path);
+    munmap(table, table_size);
+    table = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Only the poller writes, so the sequence needs no atomic increment */
+
+static void publish(const struct printer *p) {
+  struct inkd_table_slot *slot = &table->slots[p->cache.index];
+  uint32_t sequence = slot->sequence;
+
+  __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->polled = p->polled;
+  memcpy(&slot->printer, &p->cache, sizeof(struct inkd_printer));
+
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static int open_socket(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: '%s'\n", path);
+    return -1;
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* a socket left over by a previous run */
+
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(fd, MAX_CLIENTS) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Returns non zero if the connection should be closed */
+
+static int serve_client(int fd) {
+  struct inkd_request request;
+  struct inkd_reply reply;
+  struct inkd_printer answer[MAX_PRINTERS];
+  time_t now;
+  ssize_t n;
+  int first;
+  int i;
+
+  n = recv(fd, &request, sizeof(request), MSG_DONTWAIT);
+
+  if (n <= 0) {
+    return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : 1;
+  }
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = INKD_MAGIC;
+  reply.version = INKD_VERSION;
+
+  if (n != sizeof(request) || request.magic != INKD_MAGIC ||
+      request.version != INKD_VERSION) {
+    reply.status = INKD_BAD_REQUEST;
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+    return 1;
+  }
+
+  switch (request.command) {
+  case INKD_GET_ALL:
+    first = 0;
+    reply.count = printer_count;
+    break;
+
+  case INKD_GET_PRINTER:
+    if (request.printer >= (uint32_t) printer_count) {
+      reply.status = INKD_NO_SUCH_PRINTER;
+      return send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply);
+    }
+    first = request.printer;
+    reply.count = 1;
+    break;
+
+  default:
+    reply.status = INKD_BAD_REQUEST;
+    return send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply);
+  }
+
+  now = time(NULL);
+
+  pthread_mutex_lock(&cache_lock);
+  for (i = 0; i < (int) reply.count; i++) {
+    struct printer *p = &printers[first + i];
+
+    memcpy(&answer[i], &p->cache, sizeof(struct inkd_printer));
+    answer[i].age = p->polled ? (uint32_t) (now - p->polled) : ~0U;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL | MSG_MORE)
+      != sizeof(reply) ||
+      send(fd, answer, reply.count * sizeof(struct inkd_printer),
+           MSG_NOSIGNAL) != (ssize_t) (reply.count *
+                                       sizeof(struct inkd_printer))) {
+    return 1;
+  }
+
+  return 0;
+}
+
+static void on_signal(int sig) {
+  (void) sig;
+  terminate = 1;
+}
@@ -0,0 +1,109 @@
+/* inkd.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+/* Protocol between inkd and its clients on the Unix domain socket.
+ *
+ * A client sends a struct inkd_request and gets back a struct inkd_reply
+ * followed by reply.count struct inkd_printer. It may send further
+ * requests on the same connection. All numbers are in host byte order.
+ */
+
+#ifndef INKD_H
+#define INKD_H
+
+#include <stdint.h>
+
+#include <inklevel.h>
+
+#define INKD_SOCKET "/var/run/inkd.sock"
+
+#define INKD_MAGIC 0x444b4e49 /* "INKD" */
+#define INKD_VERSION 1
+
+/* Values for inkd_request.command */
+
+#define INKD_GET_ALL 1     /* all printers */
+#define INKD_GET_PRINTER 2 /* the printer with index inkd_request.printer */
+
+struct inkd_request {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t command;
+  uint32_t printer;
+};
+
+/* Values for inkd_reply.status */
+
+#define INKD_OK 0
+#define INKD_BAD_REQUEST 1
+#define INKD_NO_SUCH_PRINTER 2
+
+struct inkd_reply {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t status;
+  uint32_t count; /* number of struct inkd_printer following */
+};
+
+struct inkd_printer {
+  uint32_t index;
+  int32_t result;       /* of the last query, OK or an error of inklevel.h */
+  uint32_t generation;  /* incremented whenever the levels changed */
+  uint32_t age;         /* seconds since the last query, ~0 if none yet */
+  char model[MODEL_NAME_LENGTH];
+  uint8_t status;       /* RESPONSE_* */
+  uint8_t num_levels;
+  struct {
+    uint8_t type;       /* CARTRIDGE_* */
+    uint8_t level;
+  } levels[MAX_CARTRIDGE_TYPES];
+};
+
+/* The table inkd publishes in a file with -m, to be mapped by readers.
+ * Every printer has a fixed slot. The writer makes the sequence odd while
+ * it changes a slot, so a reader copies a slot, checks that the sequence
+ * was even and did not change meanwhile and otherwise tries again.
+ */
+
+#define INKD_TABLE_MAGIC 0x42544b49 /* "IKTB" */
+
+struct inkd_table_slot {
+  uint32_t sequence;
+  uint32_t reserved;
+  int64_t polled;              /* time() of the last query, 0 if none yet */
+  struct inkd_printer printer; /* age is not used */
+};
+
+struct inkd_table {
+  uint32_t magic;   /* written last, once the table is ready, cleared
+                       when inkd replaces the file: map it again */
+  uint16_t version; /* INKD_VERSION */
+  uint16_t slot_size;
+  uint32_t slot_count;
+  uint32_t reserved;
+  struct inkd_table_slot slots[];
+};
+
+static inline void inkd_table_read(const struct inkd_table_slot *slot,
+                                   struct inkd_table_slot *copy) {
+  uint32_t before;
+  uint32_t after;
+
+  do {
+    while ((before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE)) & 1) {
+    }
+
+    __builtin_memcpy(copy, slot, sizeof(struct inkd_table_slot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+  } while (before != after);
+
+  copy->sequence = before;
+}
+
+#endif
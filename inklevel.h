@@ -100,10 +100,375 @@ struct ink_level {
   unsigned short levels[MAX_CARTRIDGE_TYPES][2];
 };
 
+/* Status of an Epson printer as reported by the "st" command */
+
+/* Values for epson_status.version */
+
+#define EPSON_STATUS_NONE 0 /* no status received */
+#define EPSON_STATUS_OLD 1  /* old text format, only ink levels */
+#define EPSON_STATUS_ST2 2  /* binary ST2 format */
+
+/* Bits in epson_status.present, one per field found in the ST2 reply */
+
+#define EPSON_HAS_STATE (1 << 0)
+#define EPSON_HAS_ERROR (1 << 1)
+#define EPSON_HAS_SELF_PRINT (1 << 2)
+#define EPSON_HAS_WARNINGS (1 << 3)
+#define EPSON_HAS_PAPER_PATH (1 << 4)
+#define EPSON_HAS_PAPER_MISMATCH (1 << 5)
+#define EPSON_HAS_INK (1 << 6)
+#define EPSON_HAS_CANCEL (1 << 7)
+#define EPSON_HAS_TRAY (1 << 8)
+#define EPSON_HAS_TEMPERATURE (1 << 9)
+#define EPSON_HAS_PAPER_COUNT (1 << 10)
+#define EPSON_HAS_SERIAL (1 << 11)
+
+/* Values for epson_status.state */
+
+#define EPSON_STATE_ERROR 0x00
+#define EPSON_STATE_SELF_PRINTING 0x01
+#define EPSON_STATE_BUSY 0x02
+#define EPSON_STATE_WAITING 0x03
+#define EPSON_STATE_IDLE 0x04
+#define EPSON_STATE_PAUSED 0x05
+#define EPSON_STATE_CLEANING 0x07
+#define EPSON_STATE_FACTORY_SHIPMENT 0x08
+#define EPSON_STATE_SHUTDOWN 0x0a
+
+/* Some values for epson_status.error, only valid in EPSON_STATE_ERROR */
+
+#define EPSON_ERROR_FATAL 0x00
+#define EPSON_ERROR_INTERFACE 0x01
+#define EPSON_ERROR_PAPER_JAM 0x04
+#define EPSON_ERROR_INK_OUT 0x05
+#define EPSON_ERROR_PAPER_OUT 0x06
+#define EPSON_ERROR_PAPER_SIZE 0x0c
+#define EPSON_ERROR_INK_OVERFLOW 0x10
+#define EPSON_ERROR_DOUBLE_FEED 0x12
+#define EPSON_ERROR_COVER_OPEN 0x1a
+#define EPSON_ERROR_MAINTENANCE 0x41
+
+#define EPSON_MAX_WARNINGS 16
+#define EPSON_MAX_PAPER_COUNTS 8
+#define EPSON_SERIAL_LENGTH 32
+#define EPSON_MAX_FIELDS 32
+#define EPSON_RAW_LENGTH 1024
+
+struct epson_ink {
+  unsigned char code;    /* color code as sent by the printer */
+  unsigned char aux;     /* second byte of the entry */
+  unsigned short type;   /* CARTRIDGE_* */
+  unsigned short level;  /* percent remaining */
+};
+
+/* Position of a field within epson_status.raw */
+
+struct epson_field {
+  unsigned char header;
+  unsigned char length;
+  unsigned short offset; /* of the first parameter byte */
+};
+
+struct epson_status {
+  int version;
+  unsigned int present;
+  unsigned char state;
+  unsigned char error;
+  unsigned char self_print;
+  unsigned char paper_path[2];
+  unsigned char paper_mismatch;
+  unsigned char cancel;
+  unsigned char tray;
+  unsigned char temperature;
+  int num_warnings;
+  unsigned char warnings[EPSON_MAX_WARNINGS];
+  int num_inks;
+  struct epson_ink inks[MAX_CARTRIDGE_TYPES];
+  int num_paper_counts;
+  unsigned long paper_counts[EPSON_MAX_PAPER_COUNTS];
+  char serial[EPSON_SERIAL_LENGTH];
+  /* the complete reply, for fields not decoded above */
+  int num_fields;
+  struct epson_field fields[EPSON_MAX_FIELDS];
+  int raw_length;
+  unsigned char raw[EPSON_RAW_LENGTH];
+};
+
 int get_ink_level(const int port, const char*device_file, 
                   const int portnumber, struct ink_level *level);
+
+/* Where the time of a query went. Nested stages are not counted in the
+ * stage around them, e.g. opening a device while reading the device id.
+ */
+
+#define INK_STAGE_OPEN 0      /* opening the device */
+#define INK_STAGE_DEVICE_ID 1 /* reading the device id */
+#define INK_STAGE_RESOLVE 2   /* finding BJNP printers, DNS */
+#define INK_STAGE_EXCHANGE 3  /* sending commands and reading the replies */
+#define INK_STAGE_D4 4        /* D4 handshake with Epson printers */
+#define INK_STAGE_PARSE 5     /* parsing the device id and the replies */
+#define INK_STAGES 6
+
+struct ink_timing {
+  unsigned long long total_ns;
+  unsigned long long stage_ns[INK_STAGES];
+  unsigned int retries;    /* commands that were sent again */
+  unsigned int timeouts;   /* reads that got nothing in time */
+  unsigned int reopens;    /* devices opened again after a failure */
+  unsigned long bytes_in;  /* read from the printer */
+  unsigned long bytes_out; /* written to the printer */
+};
+
+/* Same as get_ink_level(), fills in timing unless it is NULL */
+
+int get_ink_level_timed(const int port, const char *device_file,
+                        const int portnumber, struct ink_level *level,
+                        struct ink_timing *timing);
 int get_ink_level_canon_simple(const int mfd, const int port,
 			const char* device_file, const int portnumber, struct ink_level *level);
 char *get_version_string(void);
 
+/* Returns the portnumber of the USB printer with the given serial number
+ * (the SN: tag of its device id) to be passed to get_ink_level() with USB,
+ * or NO_PRINTER_FOUND
+ */
+
+int get_usb_portnumber(const char *serial);
+
+/* Keep USB and parallel port devices open between queries and close them
+ * after they were not used for the given number of seconds. Some printers
+ * reset when their device is opened. An open device cannot be used by
+ * anybody else, e.g. for printing, so this is off (0) by default.
+ */
+
+void set_device_pool_timeout(const int seconds);
+/* A session queries the same printer again and again, e.g. in a poller.
+ * It remembers the last device id and status reply and only parses them
+ * again when they changed. unchanged is set to 1 if the levels are the
+ * same as in the previous successful query.
+ */
+
+struct ink_session;
+
+struct ink_session *ink_session_new(const int port, const char *device_file,
+                                    const int portnumber);
+int ink_session_get_ink_level(struct ink_session *session,
+                              struct ink_level *level, int *unchanged);
+void ink_session_free(struct ink_session *session);
+
+/* Every query of the session fills in timing, NULL stops it */
+
+void ink_session_set_timing(struct ink_session *session,
+                            struct ink_timing *timing);
+
+/* The cartridges whose levels changed between two queries of a session */
+
+#define INK_LEVEL_NONE -1 /* the cartridge was added or removed */
+
+struct ink_change {
+  unsigned short type; /* CARTRIDGE_* */
+  short old_level;
+  short new_level;
+};
+
+struct ink_delta {
+  unsigned int generation; /* of the session, counts the changes */
+  int num_changes;
+  struct ink_change changes[MAX_CARTRIDGE_TYPES];
+};
+
+int ink_session_get_ink_delta(struct ink_session *session,
+                              struct ink_level *level,
+                              struct ink_delta *delta);
+
+/* Thresholds per cartridge type of a session. The callback is called
+ * during a query when the level of a cartridge falls to or below its
+ * threshold and when it rises above threshold + hysteresis again. With
+ * a debounce of n samples, the new side has to be seen in n successful
+ * queries in a row first, 1 by default.
+ */
+
+#define INK_ALL_CARTRIDGES -1
+
+struct ink_event {
+  struct ink_session *session;
+  unsigned short type; /* CARTRIDGE_* */
+  short level;
+  short threshold;
+  short low;           /* 1 when the threshold was reached, 0 when above */
+};
+
+typedef void (*ink_threshold_callback)(const struct ink_event *event,
+                                       void *data);
+
+int ink_session_set_threshold(struct ink_session *session, const int type,
+                              const int threshold, const int hysteresis);
+int ink_session_set_debounce(struct ink_session *session, const int samples);
+void ink_session_set_threshold_callback(struct ink_session *session,
+                                        ink_threshold_callback callback,
+                                        void *data);
+
+/* Instead of or as well as calling back, the events of a session can be
+ * put into a queue, which may be shared by the sessions of a whole fleet
+ * of printers and be emptied from another thread. A full queue drops its
+ * oldest event. ink_event_queue_get() returns 1 if it took an event, 0
+ * if the queue was empty. A queue is freed after all sessions using it.
+ */
+
+struct ink_event_queue;
+
+struct ink_event_queue *ink_event_queue_new(const int capacity);
+int ink_event_queue_get(struct ink_event_queue *queue,
+                        struct ink_event *event);
+void ink_event_queue_free(struct ink_event_queue *queue);
+void ink_session_set_event_queue(struct ink_session *session,
+                                 struct ink_event_queue *queue);
+
+/* Statistics over all queries while enabled, per backend and per session.
+ * Latencies are kept in log-linear buckets of microseconds, 8 per power
+ * of two, so any percentile is within 12.5%. The counters are updated
+ * without locks, a snapshot may be taken at any time from any thread.
+ */
+
+#define INK_BACKEND_HP 0
+#define INK_BACKEND_CANON_USB 1
+#define INK_BACKEND_CANON_BJNP 2
+#define INK_BACKEND_EPSON_LEGACY 3
+#define INK_BACKEND_EPSON_D4 4
+#define INK_BACKENDS 5
+
+#define INK_STATS_BUCKETS 320
+
+struct ink_stats {
+  unsigned long long queries;
+  unsigned long long errors;          /* queries not returning OK */
+  unsigned long long protocol_errors; /* replies that could not be parsed */
+  unsigned long long timeouts;
+  unsigned long long retries;
+  unsigned long long reopens;
+  unsigned long long latency_sum_us;
+  unsigned long long latency_max_us;
+  unsigned long long latency[INK_STATS_BUCKETS]; /* queries per bucket */
+};
+
+/* Off (0) by default, queries are only counted while it is on */
+
+void set_ink_stats(const int on);
+int get_ink_stats(const int backend, struct ink_stats *stats);
+void ink_session_get_stats(struct ink_session *session,
+                           struct ink_stats *stats);
+
+/* The largest latency in microseconds falling into the given bucket */
+
+unsigned long long ink_stats_bucket_limit(const int bucket);
+
+/* The latency in microseconds below which percentile (0 - 100) of the
+ * queries were, 0 if there were none
+ */
+
+unsigned long long ink_stats_percentile(const struct ink_stats *stats,
+                                        const double percentile);
+
+/* Records a timeline of all queries, from all threads, into a buffer of
+ * max_events allocated once. Events beyond that are dropped. The trace
+ * is written with ink_trace_save() as JSON, to be opened with Perfetto
+ * (ui.perfetto.dev) or chrome://tracing. ink_trace_start() must not be
+ * called while queries are running.
+ */
+
+int ink_trace_start(const unsigned int max_events);
+void ink_trace_stop(void);
+int ink_trace_save(const char *filename);
+
+/* A transport carries the bytes between the library and the printers.
+ * By default devices are files and BJNP printers are reached over UDP.
+ * Another transport gets all of the I/O instead, e.g. to run the library
+ * without printers. Handles are >= 0, failures return -1. Reads return 0
+ * when nothing came within timeout milliseconds, -1 waits until a signal.
+ * device_id() returns the IEEE 1284 device id without the length bytes.
+ * BJNP discovery is not carried by a transport: it broadcasts on the
+ * network interfaces of the host, so with any other transport than the
+ * default no BJNP printer is found by number and bjnp://<host> is needed.
+ */
+
+struct sockaddr_in;
+
+struct ink_transport {
+  int (*open)(void *data, const char *device, const int flags);
+  int (*read)(void *data, const int handle, void *buffer, const int length,
+              const int timeout);
+  int (*write)(void *data, const int handle, const void *buffer,
+               const int length);
+  void (*close)(void *data, const int handle);
+  int (*device_id)(void *data, const int handle, char *buffer,
+                   const int length);
+  int (*dgram_open)(void *data, const struct sockaddr_in *address);
+  int (*dgram_send)(void *data, const int handle, const void *buffer,
+                    const int length);
+  int (*dgram_recv)(void *data, const int handle, void *buffer,
+                    const int length, const int timeout);
+  void *data;
+};
+
+/* NULL restores the default, must not be called while queries run */
+
+void set_ink_transport(const struct ink_transport *transport);
+
+/* A transport answering from memory. Devices are opened by their name,
+ * a device file or "a.b.c.d:port" for BJNP. A write that starts with the
+ * command of one of the exchanges queues its reply to be read.
+ */
+
+struct ink_memory_exchange {
+  const void *command;
+  int command_length;
+  const void *reply;
+  int reply_length;
+};
+
+struct ink_memory_device {
+  const char *name;      /* NULL ends the list */
+  const char *device_id; /* returned by device_id() */
+  const struct ink_memory_exchange *exchanges;
+  int num_exchanges;
+};
+
+void ink_memory_transport(struct ink_transport *transport,
+                          const struct ink_memory_device *devices);
+
+/* Transcripts of everything exchanged with printers, to reproduce them
+ * offline. ink_record_transport() sets up a transport that passes all
+ * calls on to recorded, the default transport if NULL, and writes them
+ * with their data and duration to filename. ink_replay_transport() sets
+ * up one that plays such a file back to the backends, as fast as they
+ * go or, with INK_REPLAY_TIMED, taking as long as each call did when it
+ * was recorded. Once the backends do something else than was recorded,
+ * including writing other bytes, all calls fail. BJNP commands carry a
+ * sequence number counted from the start of the process, so a BJNP
+ * transcript only replays as the first BJNP query of a process. Both
+ * return OK or ERROR. A transcript is released with
+ * ink_close_transcript() after another transport has been set, it
+ * returns ERROR if a recording could not be written completely.
+ */
+
+#define INK_REPLAY_TIMED 1
+
+int ink_record_transport(struct ink_transport *transport,
+                         const struct ink_transport *recorded,
+                         const char *filename);
+int ink_replay_transport(struct ink_transport *transport,
+                         const char *filename, const int flags);
+void ink_rewind_transcript(struct ink_transport *transport);
+int ink_close_transcript(struct ink_transport *transport);
+
+int get_epson_status(const int port, const char *device_file,
+                     const int portnumber, struct ink_level *level,
+                     struct epson_status *status);
+
+/* Remember what was learned about Epson printers in the given file, so
+ * that the identification can be skipped in later processes too.
+ * NULL disables the file, the cache is always kept in memory.
+ */
+void set_epson_cache_file(const char *filename);
+
 #endif
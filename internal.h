@@ -14,4 +14,13 @@
 #define BUFLEN 1024
 #define NR_TAGS 15
 
+/* Returned internally when a reply is the same as the previous one */
+
+#define REPLY_UNCHANGED 1
+
+/* Fails to compile if cond is false, usable outside of functions */
+
+#define STATIC_ASSERT(cond, name) \
+  typedef char static_assert_##name[(cond) ? 1 : -1]
+
 #endif
@@ -0,0 +1,362 @@
+/* inventory.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+/* Keeps a list of the USB and parallel port printers, so that a query
+ * does not have to search for its device first. The list is built once
+ * and only scanned again after inotify or a kernel uevent has reported
+ * that a printer device appeared or went away.
+ */
+
+#include "config.h"
+
+#if (HOST_OS == LINUX)
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_LINUX_NETLINK_H
+#include <linux/netlink.h>
+#endif
+
+/* ieee1284.h uses HAVE_IEEE1284_H, so we undefine it */
+#undef HAVE_IEEE1284_H
+#include <ieee1284.h>
+
+#include "internal.h"
+#include "inklevel.h"
+#include "util.h"
+#include "platform_specific.h"
+#include "inventory.h"
+
+#define SERIAL_LENGTH 64
+#define SERIAL_HASH_SIZE 32 /* a power of two, larger than INVENTORY_USB_PRINTERS */
+
+struct usb_printer {
+  char device_file[32]; /* empty if there is no such printer */
+  char serial[SERIAL_LENGTH];
+};
+
+static struct usb_printer usb_printers[INVENTORY_USB_PRINTERS];
+static signed char serial_hash[SERIAL_HASH_SIZE]; /* portnumber + 1 */
+static struct parport_list parports;
+static int have_parports = 0;
+static int initialized = 0;
+static int dirty = 1;
+static int inotify_fd = -1;
+static int uevent_fd = -1;
+static unsigned int generation = 0;
+
+/* local functions */
+
+static void update_inventory(void);
+static void watch_devices(void);
+static void check_for_changes(void);
+static int is_printer_device(const char *name);
+static void scan_usb_printers(void);
+static void read_serial(const int portnumber, char *serial);
+static unsigned int hash_serial(const char *serial);
+
+/* Returns the device file of the USB printer with the given number or NULL */
+
+const char *inventory_usb_device(const int portnumber) {
+  update_inventory();
+
+  if (portnumber < 0 || portnumber >= INVENTORY_USB_PRINTERS ||
+      usb_printers[portnumber].device_file[0] == '\0') {
+    return NULL;
+  }
+
+  return usb_printers[portnumber].device_file;
+}
+
+/* Returns the number of the USB printer with the given serial number
+ * or -1
+ */
+
+int inventory_usb_portnumber(const char *serial) {
+  unsigned int i;
+  int n;
+
+  update_inventory();
+
+  i = hash_serial(serial);
+
+  while ((n = serial_hash[i]) != 0) {
+    if (strcmp(usb_printers[n - 1].serial, serial) == 0) {
+      return n - 1;
+    }
+    i = (i + 1) & (SERIAL_HASH_SIZE - 1);
+  }
+
+  return -1;
+}
+
+/* Returns the parallel port with the given number or NULL */
+
+struct parport *inventory_parport(const int portnumber) {
+  update_inventory();
+
+  if (!have_parports || portnumber < 0 || portnumber >= parports.portc) {
+    return NULL;
+  }
+
+  return parports.portv[portnumber];
+}
+
+/* Returns a number that changes whenever printers appeared or went away */
+
+unsigned int inventory_generation(void) {
+  update_inventory();
+
+  return generation;
+}
+
+static void update_inventory(void) {
+  if (!initialized) {
+    /* Watch before scanning, so no change can get lost in between */
+
+    watch_devices();
+    initialized = 1;
+  }
+
+  check_for_changes();
+
+  if (!dirty) {
+    return;
+  }
+
+#ifdef DEBUG
+  printf("Scanning for printer devices\n");
+#endif
+
+  scan_usb_printers();
+
+  if (have_parports) {
+    ieee1284_free_ports(&parports);
+    have_parports = 0;
+  }
+
+  if (ieee1284_find_ports(&parports, 0) == E1284_OK) {
+    have_parports = 1;
+  }
+
+  dirty = 0;
+  generation++;
+}
+
+static void watch_devices(void) {
+#ifdef HAVE_LINUX_NETLINK_H
+  struct sockaddr_nl addr;
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd >= 0) {
+    /* IN_ATTRIB catches udev fixing up the permissions */
+
+    inotify_add_watch(inotify_fd, "/dev",
+                      IN_CREATE | IN_DELETE | IN_ATTRIB);
+    inotify_add_watch(inotify_fd, "/dev/usb",
+                      IN_CREATE | IN_DELETE | IN_ATTRIB);
+  }
+#endif
+
+#ifdef HAVE_LINUX_NETLINK_H
+  uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_KOBJECT_UEVENT);
+  if (uevent_fd >= 0) {
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel events */
+
+    if (bind(uevent_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close(uevent_fd);
+      uevent_fd = -1;
+    }
+  }
+#endif
+
+#ifdef DEBUG
+  printf("Watching devices: inotify %d uevent %d\n", inotify_fd, uevent_fd);
+#endif
+}
+
+/* Reads all pending notifications without blocking. Kept open devices
+ * of printers that went away are closed right here.
+ */
+
+static void check_for_changes(void) {
+  char buf[4096] __attribute__ ((aligned(8)));
+  int removed = 0;
+  int len;
+
+  if (inotify_fd < 0 && uevent_fd < 0) {
+    /* Nobody tells us about changes, so look every time */
+
+    dirty = 1;
+    return;
+  }
+
+#ifdef HAVE_SYS_INOTIFY_H
+  while (inotify_fd >= 0 && (len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    char *c = buf;
+
+    while (c < buf + len) {
+      struct inotify_event *event = (struct inotify_event *) c;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        /* events were lost */
+
+        dirty = 1;
+        removed = 1;
+      } else if (event->len > 0) {
+        if (strcmp(event->name, "usb") == 0 && (event->mask & IN_CREATE)) {
+          /* /dev/usb did not exist when we started watching */
+
+          inotify_add_watch(inotify_fd, "/dev/usb",
+                            IN_CREATE | IN_DELETE | IN_ATTRIB);
+          dirty = 1;
+        } else if (is_printer_device(event->name)) {
+          dirty = 1;
+          if (event->mask & IN_DELETE) {
+            removed = 1;
+          }
+        }
+      }
+
+      c += sizeof(struct inotify_event) + event->len;
+    }
+  }
+#endif
+
+  /* A uevent starts with "<action>@<devpath>" */
+
+  while (uevent_fd >= 0 && (len = recv(uevent_fd, buf, sizeof(buf) - 1,
+                                       MSG_DONTWAIT)) > 0) {
+    buf[len] = '\0';
+
+    if (strstr(buf, "/usbmisc/") != NULL || strstr(buf, "/parport") != NULL
+        || strstr(buf, "/ppdev/") != NULL) {
+
+#ifdef DEBUG
+      printf("uevent: %s\n", buf);
+#endif
+
+      dirty = 1;
+      if (strncmp(buf, "remove@", 7) == 0) {
+        removed = 1;
+      }
+    }
+  }
+
+  /* the socket buffer overflowed and events were lost */
+
+  if (uevent_fd >= 0 && len < 0 && errno == ENOBUFS) {
+    dirty = 1;
+    removed = 1;
+  }
+
+  if (removed) {
+    close_removed_devices();
+  }
+}
+
+static int is_printer_device(const char *name) {
+  return (strncmp(name, "lp", 2) == 0 || strncmp(name, "usblp", 5) == 0 ||
+          strncmp(name, "parport", 7) == 0);
+}
+
+static void scan_usb_printers(void) {
+  struct stat st;
+  unsigned int h;
+  int i;
+
+  memset(usb_printers, 0, sizeof(usb_printers));
+  memset(serial_hash, 0, sizeof(serial_hash));
+
+  for (i = 0; i < INVENTORY_USB_PRINTERS; i++) {
+    sprintf(usb_printers[i].device_file, "/dev/usb/lp%d", i);
+    if (stat(usb_printers[i].device_file, &st) != 0 || !S_ISCHR(st.st_mode)) {
+      sprintf(usb_printers[i].device_file, "/dev/usblp%d", i);
+      if (stat(usb_printers[i].device_file, &st) != 0 ||
+          !S_ISCHR(st.st_mode)) {
+        usb_printers[i].device_file[0] = '\0';
+        continue;
+      }
+    }
+
+    read_serial(i, usb_printers[i].serial);
+
+#ifdef DEBUG
+    printf("Found USB printer %d: %s, serial number \"%s\"\n", i,
+           usb_printers[i].device_file, usb_printers[i].serial);
+#endif
+
+    if (usb_printers[i].serial[0] != '\0') {
+      h = hash_serial(usb_printers[i].serial);
+      while (serial_hash[h] != 0) {
+        h = (h + 1) & (SERIAL_HASH_SIZE - 1);
+      }
+      serial_hash[h] = i + 1;
+    }
+  }
+}
+
+/* The serial number is taken from the device id the kernel exports,
+ * which does not need the device to be opened
+ */
+
+static void read_serial(const int portnumber, char *serial) {
+  char device_id[BUFLEN];
+  char tags[NR_TAGS][BUFLEN];
+  char sysfs_file[256];
+  const char *c;
+  FILE *f;
+  int size;
+
+  serial[0] = '\0';
+
+  sprintf(sysfs_file, "/sys/class/usbmisc/lp%d/device/ieee1284_id",
+          portnumber);
+
+  if ((f = fopen(sysfs_file, "r")) == NULL) {
+    return;
+  }
+
+  size = fread(device_id, 1, BUFLEN - 1, f);
+  fclose(f);
+
+  while (size > 0 && (device_id[size - 1] == '\n' ||
+                      device_id[size - 1] == '\0')) {
+    size--;
+  }
+  device_id[size] = '\0';
+
+  tokenize_device_id(device_id, tags);
+
+  if ((c = get_tag_value(tags, "SN:")) != NULL ||
+      (c = get_tag_value(tags, "SERN:")) != NULL ||
+      (c = get_tag_value(tags, "SERIALNUMBER:")) != NULL) {
+    strncpy(serial, c, SERIAL_LENGTH - 1);
+    serial[SERIAL_LENGTH - 1] = '\0';
+  }
+}
+
+static unsigned int hash_serial(const char *serial) {
+  return hash_bytes(serial, strlen(serial)) & (SERIAL_HASH_SIZE - 1);
+}
+#endif
@@ -0,0 +1,23 @@
+/* inventory.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+struct parport;
+
+/* USB printers with a higher number are not in the inventory */
+
+#define INVENTORY_USB_PRINTERS 16
+
+const char *inventory_usb_device(const int portnumber);
+int inventory_usb_portnumber(const char *serial);
+struct parport *inventory_parport(const int portnumber);
+unsigned int inventory_generation(void);
+
+#endif
@@ -8,7 +8,9 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "internal.h"
 #include "inklevel.h"
@@ -17,16 +19,86 @@
 #include "epson_new.h"
 #include "canon.h"
 #include "util.h"
+#include "timing.h"
+#include "stats.h"
+#include "probes.h"
+#include "trace.h"
+
+/* Values for ink_session.source, where the last levels came from */
+
+#define SESSION_NONE 0      /* no levels yet or the last query failed */
+#define SESSION_DEVICE_ID 1 /* the device id itself (HP) */
+#define SESSION_CANON 2
+#define SESSION_EPSON 3
+
+struct ink_session {
+  int port;
+  char device_file[BUFLEN];
+  int has_device_file;
+  int portnumber;
+  int source;
+  unsigned int id_hash;    /* of the last device id */
+  unsigned int reply_hash; /* of the last status reply, 0 if none */
+  struct ink_level level;  /* the last levels */
+  int have_level;          /* level is valid, also after a failed query */
+  unsigned int generation; /* incremented whenever the levels changed */
+  short threshold[MAX_CARTRIDGE_TYPES];  /* by type, -1 if none */
+  short hysteresis[MAX_CARTRIDGE_TYPES];
+  char low[MAX_CARTRIDGE_TYPES];         /* by type, below the threshold */
+  short pending[MAX_CARTRIDGE_TYPES];    /* samples seen on the other side */
+  short pending_level[MAX_CARTRIDGE_TYPES];
+  int debounce;                          /* samples needed for an event */
+  ink_threshold_callback callback;
+  void *callback_data;
+  struct ink_event_queue *queue;
+  struct ink_timing *timing;
+  struct ink_stats stats;
+};
+
+struct ink_event_queue {
+  pthread_mutex_t lock;
+  int capacity;
+  int head;   /* the oldest event */
+  int count;
+  struct ink_event events[];
+};
 
 /* local functions */
 
+static void clear_ink_level(struct ink_level *level);
+static int fetch_session_level(struct ink_session *session,
+                               struct ink_level *level, int *unchanged,
+                               int *source);
+static int query_session(struct ink_session *session, struct ink_level *level,
+                         int *unchanged, struct ink_delta *delta);
+static void check_thresholds(struct ink_session *session,
+                             const struct ink_delta *delta);
+static void check_threshold(struct ink_session *session, const int type,
+                            const int level);
+static void post_event(struct ink_session *session, const int type,
+                       const int level, const int low);
+static void diff_ink_levels(const struct ink_level *old_level, 
+                            const struct ink_level *new_level,
+                            struct ink_delta *delta);
 static int parse_device_id(const int port, const char *device_file, 
                            const int portnumber, 
-                           const char *device_id, struct ink_level *level);
+                           const char *device_id, struct ink_level *level,
+                           int *source, unsigned int *reply_hash);
+static int identify_printer(const char *device_id, char tags[NR_TAGS][BUFLEN],
+                            const char **tag_mfg, struct ink_level *level);
+static int backend_of(const int port, const int source);
 
 int get_ink_level(const int port, const char *device_file, 
                   const int portnumber, struct ink_level *level) {
+  return get_ink_level_timed(port, device_file, portnumber, level, NULL);
+}
+
+int get_ink_level_timed(const int port, const char *device_file,
+                        const int portnumber, struct ink_level *level,
+                        struct ink_timing *timing) {
+  struct ink_timing stats_timing;
   char device_id[BUFLEN];
+  int source = SESSION_NONE;
   int ret;
 
 #ifdef DEBUG
@@ -34,28 +106,589 @@ int get_ink_level(const int port, const char *device_file,
   setvbuf (stderr, NULL, _IONBF, 0);
 #endif
 
+  if (timing == NULL && stats_enabled) {
+    timing = &stats_timing;
+  }
+
+  if (timing != NULL) {
+    timing_start(timing);
+  }
+
+  TRACE_BEGIN(TRACE_QUERY, TRACE_ARG_PORT, port);
+  clear_ink_level(level);
+
+  TIMING_BEGIN(INK_STAGE_DEVICE_ID);
+  ret = get_device_id(port, device_file, portnumber, device_id);
+  TIMING_END();
+
+  if (ret == OK) {
+    TIMING_BEGIN(INK_STAGE_PARSE);
+    ret = parse_device_id(port, device_file, portnumber, device_id, level, 
+                          &source, NULL);
+    TIMING_END();
+    PROBE2(parse_done, ret, source);
+  }
+
+  TRACE_END(TRACE_ARG_RESULT, ret);
+  timing_stop();
+
+  if (stats_enabled && timing != NULL) {
+    stats_record(backend_of(port, source), NULL, ret, timing);
+  }
+
+  return ret;
+}
+
+struct ink_session *ink_session_new(const int port, const char *device_file,
+                                    const int portnumber) {
+  struct ink_session *session;
+  int i;
+
+  if ((session = calloc(1, sizeof(struct ink_session))) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < MAX_CARTRIDGE_TYPES; i++) {
+    session->threshold[i] = -1;
+  }
+
+  session->port = port;
+  session->portnumber = portnumber;
+  session->source = SESSION_NONE;
+  session->debounce = 1;
+
+  if (device_file != NULL) {
+    strncpy(session->device_file, device_file, BUFLEN - 1);
+    session->has_device_file = 1;
+  }
+
+  return session;
+}
+
+int ink_session_get_ink_level(struct ink_session *session, 
+                              struct ink_level *level, int *unchanged) {
+  struct ink_delta delta;
+
+  return query_session(session, level, unchanged, &delta);
+}
+
+/* Like ink_session_get_ink_level(), but also lists the cartridges whose
+ * levels changed since the last successful query
+ */
+
+int ink_session_get_ink_delta(struct ink_session *session,
+                              struct ink_level *level, 
+                              struct ink_delta *delta) {
+  int unchanged;
+
+  return query_session(session, level, &unchanged, delta);
+}
+
+/* type is a CARTRIDGE_* or INK_ALL_CARTRIDGES, threshold -1 removes it */
+
+int ink_session_set_threshold(struct ink_session *session, const int type,
+                              const int threshold, const int hysteresis) {
+  int i;
+
+  if (type != INK_ALL_CARTRIDGES && 
+      (type <= CARTRIDGE_NOT_PRESENT || type >= MAX_CARTRIDGE_TYPES)) {
+    return ERROR;
+  }
+
+  if (threshold < -1 || threshold > 100 || hysteresis < 0 || 
+      hysteresis > 100) {
+    return ERROR;
+  }
+
+  for (i = 0; i < MAX_CARTRIDGE_TYPES; i++) {
+    if (type == INK_ALL_CARTRIDGES || type == i) {
+      session->threshold[i] = threshold;
+      session->hysteresis[i] = hysteresis;
+    }
+  }
+
+  return OK;
+}
+
+int ink_session_set_debounce(struct ink_session *session, const int samples) {
+  if (samples < 1 || samples > 1000) {
+    return ERROR;
+  }
+
+  session->debounce = samples;
+
+  return OK;
+}
+
+void ink_session_set_threshold_callback(struct ink_session *session,
+                                        ink_threshold_callback callback,
+                                        void *data) {
+  session->callback = callback;
+  session->callback_data = data;
+}
+
+void ink_session_set_event_queue(struct ink_session *session,
+                                 struct ink_event_queue *queue) {
+  session->queue = queue;
+}
+
+struct ink_event_queue *ink_event_queue_new(const int capacity) {
+  struct ink_event_queue *queue;
+
+  if (capacity < 1 || (queue = calloc(1, sizeof(struct ink_event_queue) +
+                                      capacity * sizeof(struct ink_event)))
+      == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->capacity = capacity;
+
+  return queue;
+}
+
+int ink_event_queue_get(struct ink_event_queue *queue,
+                        struct ink_event *event) {
+  int taken = 0;
+
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->count > 0) {
+    memcpy(event, &queue->events[queue->head], sizeof(struct ink_event));
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    taken = 1;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+
+  return taken;
+}
+
+void ink_event_queue_free(struct ink_event_queue *queue) {
+  if (queue != NULL) {
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+  }
+}
+
+void ink_session_set_timing(struct ink_session *session,
+                            struct ink_timing *timing) {
+  session->timing = timing;
+}
+
+void ink_session_get_stats(struct ink_session *session,
+                           struct ink_stats *stats) {
+  stats_snapshot(&session->stats, stats);
+}
+
+void ink_session_free(struct ink_session *session) {
+  free(session);
+}
+
+static int query_session(struct ink_session *session, struct ink_level *level,
+                         int *unchanged, struct ink_delta *delta) {
+  struct ink_timing stats_timing;
+  struct ink_timing *timing = session->timing;
+  struct ink_level old_level;
+  int source;
+  int ret;
+
+  delta->num_changes = 0;
+
+  if (timing == NULL && stats_enabled) {
+    timing = &stats_timing;
+  }
+
+  if (timing != NULL) {
+    timing_start(timing);
+  }
+
+  TRACE_BEGIN(TRACE_QUERY, TRACE_ARG_PORT, session->port);
+
+  if (session->have_level) {
+    memcpy(&old_level, &session->level, sizeof(struct ink_level));
+  } else {
+    memset(&old_level, 0, sizeof(struct ink_level));
+  }
+
+  ret = fetch_session_level(session, level, unchanged, &source);
+  delta->generation = session->generation;
+
+  if (ret == OK) {
+    if (!*unchanged) {
+      diff_ink_levels(&old_level, level, delta);
+    }
+    check_thresholds(session, delta);
+  }
+
+  TRACE_END(TRACE_ARG_RESULT, ret);
+  timing_stop();
+
+  if (stats_enabled && timing != NULL) {
+    stats_record(backend_of(session->port, source), &session->stats, ret,
+                 timing);
+  }
+
+  return ret;
+}
+
+/* The device id is fetched every time. Only if it or the status reply
+ * changed, it is parsed again, otherwise the last levels are returned.
+ * source is set to where the levels were asked for, also on failure.
+ */
+
+static int fetch_session_level(struct ink_session *session,
+                               struct ink_level *level, int *unchanged,
+                               int *source) {
+  const char *device_file;
+  char device_id[BUFLEN];
+  unsigned int id_hash;
+  int ret;
+
+  device_file = session->has_device_file ? session->device_file : NULL;
+  *unchanged = 0;
+  *source = SESSION_NONE;
+  clear_ink_level(level);
+
+  TIMING_BEGIN(INK_STAGE_DEVICE_ID);
+  ret = get_device_id(session->port, device_file, session->portnumber,
+                      device_id);
+  TIMING_END();
+
+  if (ret != OK) {
+    session->source = SESSION_NONE;
+    return ret;
+  }
+
+  TIMING_BEGIN(INK_STAGE_PARSE);
+
+  id_hash = hash_bytes(device_id, strlen(device_id));
+
+  if (session->source != SESSION_NONE && id_hash == session->id_hash) {
+
+#ifdef DEBUG
+    printf("Device id unchanged\n");
+#endif
+
+    /* Still the same printer, no need to identify it again */
+
+    strcpy(level->model, session->level.model);
+
+    switch (session->source) {
+    case SESSION_CANON:
+      ret = get_ink_level_canon(session->port, device_file, 
+                                session->portnumber, level, 
+                                &session->reply_hash);
+      break;
+
+    case SESSION_EPSON:
+      ret = get_ink_level_epson(session->port, device_file, 
+                                session->portnumber, level);
+      break;
+
+    default:
+      ret = REPLY_UNCHANGED;
+      break;
+    }
+  } else {
+    session->reply_hash = 0;
+    ret = parse_device_id(session->port, device_file, session->portnumber,
+                          device_id, level, &session->source, 
+                          &session->reply_hash);
+  }
+
+  TIMING_END();
+  PROBE2(parse_done, ret, session->source);
+
+  *source = session->source;
+
+  if (ret == REPLY_UNCHANGED) {
+    memcpy(level, &session->level, sizeof(struct ink_level));
+    *unchanged = 1;
+    return OK;
+  }
+
+  if (ret != OK) {
+    session->source = SESSION_NONE;
+    return ret;
+  }
+
+  if (session->have_level && 
+      memcmp(level, &session->level, sizeof(struct ink_level)) == 0) {
+    *unchanged = 1;
+  } else {
+    session->generation++;
+  }
+
+  session->id_hash = id_hash;
+  memcpy(&session->level, level, sizeof(struct ink_level));
+  session->have_level = 1;
+
+  return OK;
+}
+
+/* Only the changed cartridges are looked at, and those still waiting for
+ * more samples to debounce a crossing, whose level did not change since.
+ * A cartridge is low once its level is at or below the threshold and
+ * stays low until it rises above threshold + hysteresis, so that coarse
+ * estimates do not cause an event on every query.
+ */
+
+static void check_thresholds(struct ink_session *session,
+                             const struct ink_delta *delta) {
+  const struct ink_change *change;
+  char changed[MAX_CARTRIDGE_TYPES];
+  int type;
+  int i;
+
+  memset(changed, 0, sizeof(changed));
+
+  for (i = 0; i < delta->num_changes; i++) {
+    change = &delta->changes[i];
+    type = change->type;
+
+    if (type >= MAX_CARTRIDGE_TYPES || session->threshold[type] < 0) {
+      continue;
+    }
+
+    changed[type] = 1;
+
+    if (change->new_level == INK_LEVEL_NONE) {
+      /* removed, a new cartridge starts over */
+      session->low[type] = 0;
+      session->pending[type] = 0;
+      continue;
+    }
+
+    check_threshold(session, type, change->new_level);
+  }
+
+  for (type = 0; type < MAX_CARTRIDGE_TYPES; type++) {
+    if (session->pending[type] > 0 && !changed[type]) {
+      check_threshold(session, type, session->pending_level[type]);
+    }
+  }
+}
+
+static void check_threshold(struct ink_session *session, const int type,
+                            const int level) {
+  int low;
+
+  if (session->low[type]) {
+    low = level <= session->threshold[type] + session->hysteresis[type];
+  } else {
+    low = level <= session->threshold[type];
+  }
+
+  if (low == session->low[type]) {
+    session->pending[type] = 0;
+    return;
+  }
+
+  session->pending_level[type] = level;
+
+  if (++session->pending[type] < session->debounce) {
+    return;
+  }
+
+  session->pending[type] = 0;
+  session->low[type] = low;
+
+#ifdef DEBUG
+  printf("Cartridge type %d %s threshold %d at %d%%\n", type,
+         low ? "reached" : "back above", session->threshold[type], level);
+#endif
+
+  post_event(session, type, level, low);
+}
+
+static void post_event(struct ink_session *session, const int type,
+                       const int level, const int low) {
+  struct ink_event_queue *queue = session->queue;
+  struct ink_event event;
+
+  event.session = session;
+  event.type = type;
+  event.level = level;
+  event.threshold = session->threshold[type];
+  event.low = low;
+
+  if (session->callback != NULL) {
+    session->callback(&event, session->callback_data);
+  }
+
+  if (queue != NULL) {
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->count == queue->capacity) {
+      /* drop the oldest */
+      queue->head = (queue->head + 1) % queue->capacity;
+      queue->count--;
+    }
+
+    memcpy(&queue->events[(queue->head + queue->count) % queue->capacity],
+           &event, sizeof(struct ink_event));
+    queue->count++;
+
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+/* Same as get_ink_level(), but returns everything an Epson printer
+ * reports in its status reply, not only the ink levels
+ */
+
+int get_epson_status(const int port, const char *device_file, 
+                     const int portnumber, struct ink_level *level,
+                     struct epson_status *status) {
+  char device_id[BUFLEN];
+  char tags[NR_TAGS][BUFLEN];  
+  const char *tag_mfg = NULL;
+  int ret;
+
+  clear_ink_level(level);
+  memset(status, 0, sizeof(struct epson_status));
+
+  if ((ret = get_device_id(port, device_file, portnumber, device_id)) != OK) {
+    return ret;
+  }
+
+  if ((ret = identify_printer(device_id, tags, &tag_mfg, level)) != OK) {
+    return ret;
+  }
+
+  if (tag_mfg == NULL || strncmp(tag_mfg, "EPSON", 5) != 0) {
+    return PRINTER_NOT_SUPPORTED;
+  }
+
+  return get_epson_status_internal(port, device_file, portnumber, level, 
+                                   status);
+}
+
+static void clear_ink_level(struct ink_level *level) {
   memset(level->model, 0, MODEL_NAME_LENGTH);
   memset(level->levels, 0, MAX_CARTRIDGE_TYPES * sizeof(unsigned short) * 2);
   level->status = RESPONSE_INVALID;
+}
 
-  if ((ret = get_device_id(port, device_file, portnumber, device_id)) == OK) {
-    if ((ret = parse_device_id(port, device_file, portnumber, device_id, 
-                               level)) == OK) {
-      return OK;
+/* Cartridges are matched by type, in the order they appear */
+
+static void diff_ink_levels(const struct ink_level *old_level, 
+                            const struct ink_level *new_level,
+                            struct ink_delta *delta) {
+  char matched[MAX_CARTRIDGE_TYPES];
+  struct ink_change *change;
+  int type;
+  int i;
+  int j;
+
+  memset(matched, 0, sizeof(matched));
+
+  for (i = 0; i < MAX_CARTRIDGE_TYPES; i++) {
+    if ((type = new_level->levels[i][INDEX_TYPE]) == CARTRIDGE_NOT_PRESENT) {
+      continue;
+    }
+
+    for (j = 0; j < MAX_CARTRIDGE_TYPES; j++) {
+      if (!matched[j] && old_level->levels[j][INDEX_TYPE] == type) {
+        break;
+      }
     }
+
+    if (j < MAX_CARTRIDGE_TYPES) {
+      matched[j] = 1;
+
+      if (old_level->levels[j][INDEX_LEVEL] == 
+          new_level->levels[i][INDEX_LEVEL]) {
+        continue;
+      }
+    }
+
+    change = &delta->changes[delta->num_changes++];
+    change->type = type;
+    change->old_level = (j < MAX_CARTRIDGE_TYPES) ? 
+      old_level->levels[j][INDEX_LEVEL] : INK_LEVEL_NONE;
+    change->new_level = new_level->levels[i][INDEX_LEVEL];
   }
 
-  return ret;
+  /* cartridges that were removed */
+
+  for (j = 0; j < MAX_CARTRIDGE_TYPES && 
+         delta->num_changes < MAX_CARTRIDGE_TYPES; j++) {
+    if (!matched[j] && 
+        old_level->levels[j][INDEX_TYPE] != CARTRIDGE_NOT_PRESENT) {
+      change = &delta->changes[delta->num_changes++];
+      change->type = old_level->levels[j][INDEX_TYPE];
+      change->old_level = old_level->levels[j][INDEX_LEVEL];
+      change->new_level = INK_LEVEL_NONE;
+    }
+  }
 }
 
-/* This function parses the device id and calls the appropiate function */
+/* This function parses the device id and calls the appropiate function.
+ * source is set to where the levels come from, reply_hash is passed on.
+ */
 
 static int parse_device_id(int port, const char *device_file, int portnumber, 
-                           const char *device_id, struct ink_level *level) {
+                           const char *device_id, struct ink_level *level,
+                           int *source, unsigned int *reply_hash) {
   const char *tag_mfg = NULL;
-  const char *c;
   char tags[NR_TAGS][BUFLEN];  
   int i;
+  int ret;
+
+  *source = SESSION_NONE;
+
+  if ((ret = identify_printer(device_id, tags, &tag_mfg, level)) != OK) {
+    return ret;
+  }
+
+  /* Check for a new HP printer (has S: tag) */
+
+  if ((i = get_tag_index(tags, "S:")) != -1) {
+    *source = SESSION_DEVICE_ID;
+    return parse_device_id_new_hp(tags, i, level);
+  }
+  
+  /* Check for an old HP printer (has VSTATUS: tag) */
+
+  if ((i = get_tag_index(tags, "VSTATUS:")) != -1) {
+    *source = SESSION_DEVICE_ID;
+    return parse_device_id_old_hp(tags, i, level);
+  }
+
+  /* Check for manufacturer */
+
+  if (tag_mfg != NULL) {
+    /* Check if it is "EPSON" */
+   
+    if (strncmp(tag_mfg, "EPSON", 5) == 0){
+      *source = SESSION_EPSON;
+      return get_ink_level_epson(port, device_file, portnumber, level);
+    } 
+
+    /* check for Canon */
+    if (strncmp(tag_mfg, "Canon", 5) == 0) {
+      *source = SESSION_CANON;
+      return get_ink_level_canon(port, device_file, portnumber, level, 
+                                 reply_hash);
+    }
+
+    /* Insert code to check for other printers here */
+    
+  }
+  
+  return PRINTER_NOT_SUPPORTED; /* No matching printer was found */
+}
+
+/* This function checks that the device id belongs to a printer and fills
+ * in its name
+ */
+
+static int identify_printer(const char *device_id, char tags[NR_TAGS][BUFLEN],
+                            const char **tag_mfg, struct ink_level *level) {
+  const char *c;
 
   tokenize_device_id(device_id, tags);
 
@@ -96,7 +729,7 @@ static int parse_device_id(int port, const char *device_file, int portnumber,
   if ((c = get_tag_value(tags, "MFG:")) != NULL) {
     strncpy(level->model, c, MODEL_NAME_LENGTH-1);
     level->model[MODEL_NAME_LENGTH-1] = '\0';
-    tag_mfg = c;
+    *tag_mfg = c;
   }
 
   /* append a space character after manufacturer */
@@ -110,36 +743,27 @@ static int parse_device_id(int port, const char *device_file, int portnumber,
     strncat(level->model, c, MODEL_NAME_LENGTH -1 - strlen(level->model));
     level->model[MODEL_NAME_LENGTH-1] = '\0';
   } 
-  
-  /* Check for a new HP printer (has S: tag) */
 
-  if ((i = get_tag_index(tags, "S:")) != -1)
-    return parse_device_id_new_hp(tags, i, level);
-  
-  /* Check for an old HP printer (has VSTATUS: tag) */
+  return OK;
+}
 
-  if ((i = get_tag_index(tags, "VSTATUS:")) != -1) {
-    return parse_device_id_old_hp(tags, i, level);
-  }
+/* Which backend a query with the given source went to, -1 if none */
 
-  /* Check for manufacturer */
+static int backend_of(const int port, const int source) {
+  switch (source) {
+  case SESSION_DEVICE_ID:
+    return INK_BACKEND_HP;
 
-  if (tag_mfg != NULL) {
-    /* Check if it is "EPSON" */
-   
-    if (strncmp(tag_mfg, "EPSON", 5) == 0){
-      return get_ink_level_epson(port, device_file, portnumber, level);
-    } 
+  case SESSION_CANON:
+    return (port == BJNP || port == CUSTOM_BJNP) ? 
+      INK_BACKEND_CANON_BJNP : INK_BACKEND_CANON_USB;
 
-    /* check for Canon */
-    if (strncmp(tag_mfg, "Canon", 5) == 0)
-      return get_ink_level_canon(port, device_file, portnumber, level);
+  case SESSION_EPSON:
+    return epson_uses_d4() ? INK_BACKEND_EPSON_D4 : INK_BACKEND_EPSON_LEGACY;
 
-    /* Insert code to check for other printers here */
-    
+  default:
+    return -1;
   }
-  
-  return PRINTER_NOT_SUPPORTED; /* No matching printer was found */
 }
 
 char *get_version_string(void) {
@@ -15,6 +15,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <time.h>
 
 /* ieee1284.h uses HAVE_IEEE1284_H, so we undefine it */
 #undef HAVE_IEEE1284_H
@@ -24,50 +27,88 @@
 #include "inklevel.h"
 #include "platform_specific.h"
 #include "bjnp.h"
+#include "d4lib.h"
+#include "inventory.h"
+#include "timing.h"
+#include "probes.h"
+#include "transport.h"
 
 #define IOCNR_GET_DEVICE_ID 1
 #define LPIOC_GET_DEVICE_ID _IOC(_IOC_READ, 'P', IOCNR_GET_DEVICE_ID, BUFLEN)
 
+/* Devices kept open between queries, see set_device_pool_timeout() */
+
+#define MAX_POOLED_DEVICES 8
+
+struct pooled_device {
+  char device_file[256]; /* empty if the entry is not used */
+  int fd;
+  dev_t rdev;
+  time_t last_used;
+};
+
+static struct pooled_device device_pool[MAX_POOLED_DEVICES];
+static int pool_timeout = 0;
+static unsigned int pool_generation = 0;
+
+static int get_device_id_sysfs(const int port, const char *device_file, 
+                               const int portnumber, char *device_id);
+static int levels_in_device_id(const char *device_id);
+static const char *usb_device_file(const int portnumber, char *buffer);
+static int pool_lookup(const char *device_file);
+static int pool_get(const char *device_file);
+static void pool_add(const char *device_file, const int fd);
+static void pool_remove(const int i);
+static void pool_expire(void);
+static int device_is_healthy(const int fd);
+
 /* This function retrieves the device id of the specified port */
 
 int get_device_id(const int port, const char *device_file, 
                   const int portnumber, char *device_id) {
-  struct parport_list parports;
+  struct parport *parport;
+  const char *usb_device;
   char tmp[BUFLEN];
   char device_file1[256];
-  char device_file2[256];
   int size;
   int fd;
-  char *c;
-  int realsize;
 
   if (port == PARPORT ) {
     /* check if we have appropiate permissions */
 
     sprintf(device_file1, "/dev/parport%d", portnumber);
 
-    if ((fd = open(device_file1, O_RDWR)) < 0) {
+    TIMING_BEGIN(INK_STAGE_OPEN);
+    fd = open(device_file1, O_RDWR);
+    TIMING_END();
+
+    if (fd < 0) {
       return DEV_PARPORT_INACCESSIBLE;
     }
 
     close(fd);
 
     sprintf(device_file1, "/dev/lp%d", portnumber);
-    
-    if ((fd = open(device_file1, O_RDWR)) < 0) {
-      return DEV_LP_INACCESSIBLE;
-    }
 
-    close(fd);
+    /* lp allows only one open, a pooled device proves the access */
+
+    if (pool_get(device_file1) < 0) {
+      TIMING_BEGIN(INK_STAGE_OPEN);
+      fd = open(device_file1, O_RDWR);
+      TIMING_END();
 
-    if (ieee1284_find_ports(&parports, 0) == E1284_OK) {
-      if (portnumber < parports.portc) {
-	size = ieee1284_get_deviceid(parports.portv[portnumber], -1, 
-                                     F1284_FRESH, tmp, BUFLEN);
-	if (size >= 2) {
-	  strncpy(device_id, tmp + 2, size - 2);
-	  return OK;
-	}
+      if (fd < 0) {
+        return DEV_LP_INACCESSIBLE;
+      }
+
+      close(fd);
+    }
+
+    if ((parport = inventory_parport(portnumber)) != NULL) {
+      size = ieee1284_get_deviceid(parport, -1, F1284_FRESH, tmp, BUFLEN);
+      if (size >= 2) {
+        strncpy(device_id, tmp + 2, size - 2);
+        return OK;
       }
     }
 
@@ -75,51 +116,48 @@ int get_device_id(const int port, const char *device_file,
 
   } else if (port == USB || port == CUSTOM_USB) {
 
+    /* Reading the copy the kernel keeps in sysfs does not need the
+       device file, which may be busy while a job is printing. The copy
+       is only as fresh as the last ioctl, so it is good enough to tell
+       Canon and Epson printers apart, whose levels are queried with
+       commands, but not for the levels HP puts into the device id. */
+
+    if (transport_is_fd() &&
+        get_device_id_sysfs(port, device_file, portnumber, device_id) == OK &&
+        !levels_in_device_id(device_id)) {
+      return OK;
+    }
+
     if (port == USB) {
-      sprintf(device_file1, "/dev/usb/lp%d", portnumber);
-      sprintf(device_file2, "/dev/usblp%d", portnumber);
-      fd = open(device_file1, O_RDONLY);
-      if (fd == -1) {
-        fd = open(device_file2, O_RDONLY);
-      }
-      if (fd == -1) {
+      if ((usb_device = usb_device_file(portnumber, device_file1)) == NULL) {
         return DEV_USB_LP_INACCESSIBLE;
       }
     } else {
-      fd = open(device_file, O_RDONLY);
-      if (fd == -1) {
-        return DEV_CUSTOM_USB_INACCESSIBLE;
-      }
+      usb_device = device_file;
     }
 
-    if (ioctl(fd, LPIOC_GET_DEVICE_ID, tmp) < 0) {
-      close(fd);
-      return COULD_NOT_GET_DEVICE_ID;
-    }
-    close(fd);
-    size = ((unsigned char) tmp[0] << 8) | ((unsigned char) tmp[1]);
+    /* usblp allows only one open, so ask a pooled device */
 
-    /* Some printers report the size of the device id incorrectly. */
+    if ((fd = pool_get(usb_device)) >= 0) {
+      size = transport_device_id(fd, device_id, BUFLEN);
+      PROBE2(device_id_ioctl, fd, size);
 
-    realsize = 2;
-    c = &tmp[2];
-    while (*c++ != '\0') {
-      realsize++;
+      return (size > 0) ? OK : COULD_NOT_GET_DEVICE_ID;
     }
 
-#ifdef DEBUG
-    printf("Printer reported size %d, real size is %d\n", size, realsize);
-#endif
-
-    size = (realsize < size) ? realsize : size;
-    size = (size < BUFLEN - 1) ? size : BUFLEN - 1;
-    tmp[size] = '\0';
-    if (size >= 2) {
-      strncpy(device_id, tmp + 2, size - 2);
-      return OK;
-    } else {
-      return COULD_NOT_GET_DEVICE_ID;
+    TIMING_BEGIN(INK_STAGE_OPEN);
+    fd = transport_open(usb_device, O_RDONLY);
+    TIMING_END();
+    if (fd == -1) {
+      return (port == USB) ? DEV_USB_LP_INACCESSIBLE :
+        DEV_CUSTOM_USB_INACCESSIBLE;
     }
+
+    size = transport_device_id(fd, device_id, BUFLEN);
+    PROBE2(device_id_ioctl, fd, size);
+    transport_close(fd);
+
+    return (size > 0) ? OK : COULD_NOT_GET_DEVICE_ID;
   } else if (port == CUSTOM_BJNP)  {
     return bjnp_get_id_from_named_printer(portnumber, device_file, device_id);
   } else if (port == BJNP) {
@@ -129,15 +167,147 @@ int get_device_id(const int port, const char *device_file,
   }
 }
 
+/* The device id as usblp returns it starts with its length in two bytes,
+ * which some printers get wrong
+ */
+
+int get_device_id_fd(const int fd, char *device_id, const int length) {
+  char tmp[BUFLEN];
+  int size;
+  int realsize;
+  char *c;
+
+  if (ioctl(fd, LPIOC_GET_DEVICE_ID, tmp) < 0) {
+    return -1;
+  }
+
+  size = ((unsigned char) tmp[0] << 8) | ((unsigned char) tmp[1]);
+
+  /* Some printers report the size of the device id incorrectly. */
+
+  realsize = 2;
+  c = &tmp[2];
+  while (realsize < BUFLEN - 1 && *c++ != '\0') {
+    realsize++;
+  }
+
+#ifdef DEBUG
+  printf("Printer reported size %d, real size is %d\n", size, realsize);
+#endif
+
+  size = (realsize < size) ? realsize : size;
+  size = (size < length + 1) ? size : length + 1;
+  if (size < 2) {
+    return -1;
+  }
+
+  memcpy(device_id, tmp + 2, size - 2);
+  device_id[size - 2] = '\0';
+
+  return size - 2;
+}
+
+/* Only Canon and Epson printers are asked for their levels, the others
+ * report them in the device id
+ */
+
+static int levels_in_device_id(const char *device_id) {
+  const char *mfg = strstr(device_id, "MFG:");
+
+  if (mfg == NULL) {
+    return 1;
+  }
+
+  return strncmp(mfg + 4, "EPSON", 5) != 0 &&
+    strncmp(mfg + 4, "Canon", 5) != 0;
+}
+
+/* The usblp driver exports the device id as 
+ * /sys/class/usbmisc/lpN/device/ieee1284_id. It is read from the printer
+ * when the device is probed and every time LPIOC_GET_DEVICE_ID is issued.
+ */
+
+/* Returns the device file of the USB printer with the given number or
+ * NULL. The inventory knows the first INVENTORY_USB_PRINTERS, the device
+ * files of the others are probed, buffer holds the one found.
+ */
+
+static const char *usb_device_file(const int portnumber, char *buffer) {
+  struct stat st;
+
+  if (portnumber < INVENTORY_USB_PRINTERS) {
+    return inventory_usb_device(portnumber);
+  }
+
+  sprintf(buffer, "/dev/usb/lp%d", portnumber);
+  if (stat(buffer, &st) == 0 && S_ISCHR(st.st_mode)) {
+    return buffer;
+  }
+
+  sprintf(buffer, "/dev/usblp%d", portnumber);
+  if (stat(buffer, &st) == 0 && S_ISCHR(st.st_mode)) {
+    return buffer;
+  }
+
+  return NULL;
+}
+
+static int get_device_id_sysfs(const int port, const char *device_file, 
+                               const int portnumber, char *device_id) {
+  char sysfs_file[256];
+  struct stat st;
+  FILE *f;
+  int size;
+
+  if (port == USB) {
+    sprintf(sysfs_file, "/sys/class/usbmisc/lp%d/device/ieee1284_id", 
+            portnumber);
+  } else {
+    /* A custom device file may have any name, so look it up by its 
+       device number */
+
+    if (stat(device_file, &st) != 0 || !S_ISCHR(st.st_mode)) {
+      return COULD_NOT_GET_DEVICE_ID;
+    }
+    sprintf(sysfs_file, "/sys/dev/char/%u:%u/device/ieee1284_id", 
+            major(st.st_rdev), minor(st.st_rdev));
+  }
+
+  if ((f = fopen(sysfs_file, "r")) == NULL) {
+    return COULD_NOT_GET_DEVICE_ID;
+  }
+
+  size = fread(device_id, 1, BUFLEN - 1, f);
+  fclose(f);
+
+  /* strip the trailing newline */
+
+  while (size > 0 && (device_id[size - 1] == '\n' || 
+                      device_id[size - 1] == '\0')) {
+    size--;
+  }
+  device_id[size] = '\0';
+
+#ifdef DEBUG
+  printf("Device id from %s: %s\n", sysfs_file, device_id);
+#endif
+
+  return (size > 0) ? OK : COULD_NOT_GET_DEVICE_ID;
+}
+
 int open_printer_device(const int port, const char *device_file,
                         const int portnumber) {
+  const char *usb_device;
   char device_file1[256];
-  char device_file2[256];
   int fd;
 
   if (port == USB) {
-    sprintf(device_file1, "/dev/usb/lp%d", portnumber);
-    sprintf(device_file2, "/dev/usblp%d", portnumber);
+    if ((usb_device = usb_device_file(portnumber, device_file1)) == NULL) {
+      return DEV_USB_LP_INACCESSIBLE;
+    }
+    if (usb_device != device_file1) {
+      strcpy(device_file1, usb_device);
+    }
   } else if (port == PARPORT) {
     sprintf(device_file1, "/dev/lp%d", portnumber);
   } else if (port == CUSTOM_USB) {
@@ -151,23 +321,16 @@ int open_printer_device(const int port, const char *device_file,
   printf("Device file: %s\n", device_file1);
 #endif
 
-  fd = open(device_file1, O_RDWR);
-
-  if (fd == -1 && port == USB) {
+  if ((fd = pool_get(device_file1)) >= 0) {
+    return fd;
+  }
 
-#ifdef DEBUG
-    printf("Could not open %s\n", device_file1);
-    printf("Device file: %s\n", device_file2);
-#endif
+  TIMING_BEGIN(INK_STAGE_OPEN);
+  fd = transport_open(device_file1, O_RDWR);
+  TIMING_END();
+  PROBE2(device_open, device_file1, fd);
 
-    fd = open(device_file2, O_RDWR);
-    
-    if (fd == -1) {
-#ifdef DEBUG
-      printf("Could not open %s\n", device_file2);
-#endif
-    }
-  } else if (fd == -1 && (port == PARPORT || port == CUSTOM_USB)) {
+  if (fd == -1) {
 
 #ifdef DEBUG
     printf("Could not open %s\n", device_file1);
@@ -184,7 +347,212 @@ int open_printer_device(const int port, const char *device_file,
       return DEV_LP_INACCESSIBLE;
     }
   } else {
+    /* the descriptor may be reused, forget the credit of the old device */
+
+    clearCredit(fd);
+    if (pool_timeout > 0 && transport_is_fd()) {
+      pool_add(device_file1, fd);
+    }
     return fd;
   }
 }
+
+/* Closes a device opened by open_printer_device(), unless it is kept in
+ * the pool
+ */
+
+void close_printer_device(const int fd) {
+  int i;
+
+  for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+    if (device_pool[i].device_file[0] != '\0' && device_pool[i].fd == fd) {
+      device_pool[i].last_used = time(NULL);
+      return;
+    }
+  }
+
+  PROBE1(device_close, fd);
+  clearCredit(fd);
+  transport_close(fd);
+}
+
+int is_pooled_device(const int fd) {
+  int i;
+
+  for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+    if (device_pool[i].device_file[0] != '\0' && device_pool[i].fd == fd) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void set_device_pool_timeout(const int seconds) {
+  int i;
+
+  pool_timeout = (seconds > 0) ? seconds : 0;
+
+  if (pool_timeout == 0) {
+    for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+      if (device_pool[i].device_file[0] != '\0') {
+        pool_remove(i);
+      }
+    }
+  }
+}
+
+static int pool_lookup(const char *device_file) {
+  int i;
+
+  for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+    if (strcmp(device_pool[i].device_file, device_file) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Returns the pooled descriptor of device_file if it is still usable,
+ * -1 if there is none
+ */
+
+static int pool_get(const char *device_file) {
+  int i;
+
+  if (pool_timeout == 0 || !transport_is_fd() || device_file[0] == '\0') {
+    return -1;
+  }
+
+  pool_expire();
+
+  if ((i = pool_lookup(device_file)) < 0) {
+    return -1;
+  }
+
+  if (!device_is_healthy(device_pool[i].fd)) {
+    pool_remove(i);
+    TIMING_REOPEN();
+    return -1;
+  }
+
+#ifdef DEBUG
+  printf("Reusing open device %s\n", device_file);
+#endif
+
+  device_pool[i].last_used = time(NULL);
+
+  return device_pool[i].fd;
+}
+
+static void pool_add(const char *device_file, const int fd) {
+  struct stat st;
+  int oldest = 0;
+  int i;
+
+  if (fstat(fd, &st) != 0) {
+    return;
+  }
+
+  /* use a free entry or replace the one unused for the longest time */
+
+  for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+    if (device_pool[i].device_file[0] == '\0') {
+      oldest = i;
+      break;
+    }
+    if (device_pool[i].last_used < device_pool[oldest].last_used) {
+      oldest = i;
+    }
+  }
+
+  if (device_pool[oldest].device_file[0] != '\0') {
+    pool_remove(oldest);
+  }
+
+  strncpy(device_pool[oldest].device_file, device_file, 255);
+  device_pool[oldest].device_file[255] = '\0';
+  device_pool[oldest].fd = fd;
+  device_pool[oldest].rdev = st.st_rdev;
+  device_pool[oldest].last_used = time(NULL);
+}
+
+static void pool_remove(const int i) {
+
+#ifdef DEBUG
+  printf("Closing pooled device %s\n", device_pool[i].device_file);
+#endif
+
+  PROBE1(device_close, device_pool[i].fd);
+  clearCredit(device_pool[i].fd);
+  close(device_pool[i].fd);
+  device_pool[i].device_file[0] = '\0';
+}
+
+void close_removed_devices(void) {
+  struct stat st;
+  int i;
+
+  for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+    if (device_pool[i].device_file[0] != '\0' &&
+        (stat(device_pool[i].device_file, &st) != 0 ||
+         st.st_rdev != device_pool[i].rdev)) {
+      pool_remove(i);
+    }
+  }
+}
+
+/* Closes devices that were idle for too long and, when the inventory 
+ * reports that printers came or went, those that are gone
+ */
+
+static void pool_expire(void) {
+  unsigned int generation = inventory_generation();
+  time_t now = time(NULL);
+  int i;
+
+  for (i = 0; i < MAX_POOLED_DEVICES; i++) {
+    if (device_pool[i].device_file[0] != '\0' &&
+        now - device_pool[i].last_used >= pool_timeout) {
+      pool_remove(i);
+    }
+  }
+
+  if (generation != pool_generation) {
+    close_removed_devices();
+  }
+
+  pool_generation = generation;
+}
+
+/* usblp reports POLLHUP/POLLERR once the printer is disconnected */
+
+static int device_is_healthy(const int fd) {
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  if (poll(&pfd, 1, 0) < 0) {
+    return 0;
+  }
+
+  return !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+/* This function returns the number of the USB printer with the given 
+ * serial number
+ */
+
+int get_usb_portnumber(const char *serial) {
+  int portnumber;
+
+  if ((portnumber = inventory_usb_portnumber(serial)) < 0) {
+    return NO_PRINTER_FOUND;
+  }
+
+  return portnumber;
+}
 #endif
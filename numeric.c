@@ -0,0 +1,158 @@
+/* numeric.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+/* Decoding of the hex and decimal numbers printers report their levels in.
+ * A whole field is turned into digit values in one pass, 16 or 32
+ * characters at a time where SSE2 or AVX2 is available, so the parsers
+ * only have to pick out the bytes they need.
+ */
+
+#include "config.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "numeric.h"
+
+#define D(c) [c] = (c) - '0'
+#define H(c) [c] = (c) - 'a' + 10, [(c) - 'a' + 'A'] = (c) - 'a' + 10
+
+const unsigned char hex_digit_value[256] = {
+  D('0'), D('1'), D('2'), D('3'), D('4'),
+  D('5'), D('6'), D('7'), D('8'), D('9'),
+  H('a'), H('b'), H('c'), H('d'), H('e'), H('f')
+};
+
+#undef D
+#undef H
+
+/* local functions */
+
+#ifdef __SSE2__
+static __m128i decode_16(const __m128i v);
+#endif
+
+#ifdef __AVX2__
+static __m256i decode_32(const __m256i v);
+#endif
+
+/* Stores the value of each of the length hex digits of s in nibbles.
+ * Characters that are no hex digits count as 0. Returns length.
+ */
+
+int decode_nibbles(const char *s, const int length, unsigned char *nibbles) {
+  int i = 0;
+
+#ifdef __AVX2__
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+
+    _mm256_storeu_si256((__m256i *) (nibbles + i), decode_32(v));
+  }
+#endif
+
+#ifdef __SSE2__
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+
+    _mm_storeu_si128((__m128i *) (nibbles + i), decode_16(v));
+  }
+#endif
+
+  for (; i < length; i++) {
+    nibbles[i] = hex_digit_value[(unsigned char) s[i]];
+  }
+
+  return length;
+}
+
+/* Value of the two hex digits at s */
+
+int decode_hex_byte(const char *s) {
+  return (hex_digit_value[(unsigned char) s[0]] << 4) |
+    hex_digit_value[(unsigned char) s[1]];
+}
+
+/* Value of the given number of decimal digits at s, non digits count as 0 */
+
+int decode_decimal_digits(const char *s, const int digits) {
+  int r = 0;
+  int i;
+
+  for (i = 0; i < digits; i++) {
+    unsigned char c = s[i];
+
+    r = r * 10 + ((c >= '0' && c <= '9') ? c - '0' : 0);
+  }
+
+  return r;
+}
+
+/* Value of the decimal number at s, after optional blanks and sign */
+
+int decode_decimal(const char *s) {
+  int negative = 0;
+  int r = 0;
+
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+
+  if (*s == '-' || *s == '+') {
+    negative = (*s++ == '-');
+  }
+
+  while (*s >= '0' && *s <= '9') {
+    r = r * 10 + (*s++ - '0');
+  }
+
+  return negative ? -r : r;
+}
+
+#ifdef __SSE2__
+
+/* Characters >= 0x80 compare as negative, so they are no digits either */
+
+static __m128i decode_16(const __m128i v) {
+  const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+  const __m128i letter =
+    _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                  _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+  return _mm_or_si128(
+    _mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+    _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+#endif
+
+#ifdef __AVX2__
+
+static __m256i decode_32(const __m256i v) {
+  const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  const __m256i digit =
+    _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+  const __m256i letter =
+    _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+
+  return _mm256_or_si256(
+    _mm256_and_si256(digit, _mm256_sub_epi8(v, _mm256_set1_epi8('0'))),
+    _mm256_and_si256(letter,
+                     _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+}
+
+#endif
@@ -0,0 +1,26 @@
+/* numeric.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef NUMERIC_H
+#define NUMERIC_H
+
+/* Value of every character as hex digit, 0 for non digits */
+
+extern const unsigned char hex_digit_value[256];
+
+/* The byte written as two hex digits at pos of a decoded string */
+
+#define HEX_BYTE(nibbles, pos) \
+  (((nibbles)[(pos)] << 4) | (nibbles)[(pos) + 1])
+
+int decode_nibbles(const char *s, const int length, unsigned char *nibbles);
+int decode_hex_byte(const char *s);
+int decode_decimal_digits(const char *s, const int digits);
+int decode_decimal(const char *s);
+
+#endif
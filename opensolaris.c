@@ -23,17 +23,18 @@
 #include "inklevel.h"
 #include "platform_specific.h"
 #include "bjnp.h"
+#include "d4lib.h"
+#include "timing.h"
+#include "probes.h"
+#include "transport.h"
 
 /* This function retrieves the device id of the specified port */
 
 int get_device_id(const int port, const char *device_file, 
                   const int portnumber, char *device_id) {
-  char tmp[BUFLEN];
   char my_device_file[256];
   int size;
   int fd;
-  struct prn_1284_device_id id;
-  int rc;
  
   if (port == CUSTOM_BJNP) {
     return bjnp_get_id_from_named_printer(portnumber, device_file, device_id);
@@ -49,7 +50,9 @@ int get_device_id(const int port, const char *device_file,
     return UNKNOWN_PORT_SPECIFIED;
   }
 
-  fd = open(my_device_file, O_RDONLY);
+  TIMING_BEGIN(INK_STAGE_OPEN);
+  fd = transport_open(my_device_file, O_RDONLY);
+  TIMING_END();
 
   if (fd == -1) {
     switch (port) {
@@ -62,29 +65,34 @@ int get_device_id(const int port, const char *device_file,
     }
   }
   
-  /* get the IEEE 1284 device id */
+  size = transport_device_id(fd, device_id, BUFLEN);
+  PROBE2(device_id_ioctl, fd, size);
+  transport_close(fd);
+
+  return (size > 0) ? OK : COULD_NOT_GET_DEVICE_ID;
+}
+
+/* This function gets the IEEE 1284 device id of an open device */
+
+int get_device_id_fd(const int fd, char *device_id, const int length) {
+  struct prn_1284_device_id id;
+  char tmp[BUFLEN];
+  int size;
+
   memset(&id, 0, sizeof (id));
   memset(&tmp, 0, sizeof (tmp));
   id.id_len = sizeof (tmp);
   id.id_data = tmp;
-  
-  rc = ioctl(fd, PRNIOC_GET_1284_DEVID, &id);
-  
-  if (rc < 0) {
-    close(fd);
-    return COULD_NOT_GET_DEVICE_ID;
-  }
-  close(fd);
 
-  size = id.id_rlen;
-  tmp[size] = '\0';
-  
-  if (size > 0) {
-    strncpy(device_id, tmp, size + 1);
-    return OK;
-  } else {
-    return COULD_NOT_GET_DEVICE_ID;
+  if (ioctl(fd, PRNIOC_GET_1284_DEVID, &id) < 0) {
+    return -1;
   }
+
+  size = (id.id_rlen < length) ? id.id_rlen : length - 1;
+  memcpy(device_id, tmp, size);
+  device_id[size] = '\0';
+
+  return size;
 }
 
 int open_printer_device(const int port, const char *device_file,
@@ -107,7 +115,10 @@ int open_printer_device(const int port, const char *device_file,
   printf("Device file: %s\n", my_device_file);
 #endif
 
-  fd = open(my_device_file, O_RDWR);
+  TIMING_BEGIN(INK_STAGE_OPEN);
+  fd = transport_open(my_device_file, O_RDWR);
+  TIMING_END();
+  PROBE2(device_open, my_device_file, fd);
 
   if (fd == -1) {
 
@@ -123,7 +134,29 @@ int open_printer_device(const int port, const char *device_file,
       return DEV_LP_INACCESSIBLE;
     }
   } else {
+    clearCredit(fd);
     return fd;
   }
 }
+
+/* Serial numbers are not known here */
+
+int get_usb_portnumber(const char *serial) {
+  return NO_PRINTER_FOUND;
+}
+
+void close_printer_device(const int fd) {
+  PROBE1(device_close, fd);
+  clearCredit(fd);
+  transport_close(fd);
+}
+
+int is_pooled_device(const int fd) {
+  return 0;
+}
+
+/* Devices are not kept open on this platform */
+
+void set_device_pool_timeout(const int seconds) {
+}
 #endif
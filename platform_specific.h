@@ -10,3 +10,17 @@ int get_device_id(const int port, const char *device_file,
                   const int portnumber, char *device_id);
 int open_printer_device(const int port, const char* device_file, 
                         const int portnumber);
+void close_printer_device(const int fd);
+
+/* Tells whether close_printer_device() keeps fd open for the next query */
+
+int is_pooled_device(const int fd);
+
+/* Closes the kept open devices whose device file went away, called by the
+   inventory as soon as it hears of it */
+
+void close_removed_devices(void);
+
+/* Reads the device id of an open device for the default transport */
+
+int get_device_id_fd(const int fd, char *device_id, const int length);
@@ -0,0 +1,45 @@
+/* probes.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints of the provider libinklevel, e.g. for
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libinklevel.so:libinklevel:bjnp_recv
+ *                { printf("%d %d\n", arg1, arg2); }'
+ *
+ * A probe is a single nop until a tracer attaches to it, the arguments
+ * are only moved into registers. Without <sys/sdt.h> nothing is left.
+ *
+ *   device_open(path, fd)            device_close(fd)
+ *   device_id_ioctl(fd, result)      parse_done(result, source)
+ *   canon_command(fd, length)        canon_response(fd, length)
+ *   bjnp_send(code, seq_no, length)  bjnp_recv(code, seq_no, length)
+ *   d4_transaction_start(fd, command)
+ *   d4_transaction_end(fd, command, result)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(libinklevel, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(libinklevel, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(libinklevel, name, a, b, c)
+
+#else
+
+#define PROBE1(name, a) do { (void) (a); } while (0)
+#define PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) \
+  do { (void) (a); (void) (b); (void) (c); } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+/* stats.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "inklevel.h"
+#include "stats.h"
+
+/* Latencies below 2^SUB_BITS microseconds have a bucket each, above that
+ * every power of two is split into 2^SUB_BITS buckets
+ */
+
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+
+#define ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+int stats_enabled = 0;
+
+static struct ink_stats backend_stats[INK_BACKENDS];
+
+/* local functions */
+
+static void add_query(struct ink_stats *stats, const int result,
+                      const struct ink_timing *timing);
+static int bucket_of(const unsigned long long us);
+
+void set_ink_stats(const int on) {
+  stats_enabled = on;
+}
+
+int get_ink_stats(const int backend, struct ink_stats *stats) {
+  if (backend < 0 || backend >= INK_BACKENDS) {
+    return ERROR;
+  }
+
+  stats_snapshot(&backend_stats[backend], stats);
+
+  return OK;
+}
+
+void stats_record(const int backend, struct ink_stats *session, 
+                  const int result, const struct ink_timing *timing) {
+  if (backend >= 0 && backend < INK_BACKENDS) {
+    add_query(&backend_stats[backend], result, timing);
+  }
+
+  if (session != NULL) {
+    add_query(session, result, timing);
+  }
+}
+
+/* The fields are read one by one, a query counted meanwhile may be seen
+ * in some of them only
+ */
+
+void stats_snapshot(const struct ink_stats *from, struct ink_stats *to) {
+  int i;
+
+  to->queries = LOAD(from->queries);
+  to->errors = LOAD(from->errors);
+  to->protocol_errors = LOAD(from->protocol_errors);
+  to->timeouts = LOAD(from->timeouts);
+  to->retries = LOAD(from->retries);
+  to->reopens = LOAD(from->reopens);
+  to->latency_sum_us = LOAD(from->latency_sum_us);
+  to->latency_max_us = LOAD(from->latency_max_us);
+
+  for (i = 0; i < INK_STATS_BUCKETS; i++) {
+    to->latency[i] = LOAD(from->latency[i]);
+  }
+}
+
+unsigned long long ink_stats_bucket_limit(const int bucket) {
+  int shift;
+
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+
+  shift = bucket / SUB_BUCKETS - 1;
+
+  return ((unsigned long long) (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) 
+          << shift) - 1;
+}
+
+unsigned long long ink_stats_percentile(const struct ink_stats *stats,
+                                        const double percentile) {
+  unsigned long long total = 0;
+  unsigned long long seen = 0;
+  double rank;
+  int i;
+
+  for (i = 0; i < INK_STATS_BUCKETS; i++) {
+    total += stats->latency[i];
+  }
+
+  if (total == 0) {
+    return 0;
+  }
+
+  rank = total * percentile / 100.0;
+
+  for (i = 0; i < INK_STATS_BUCKETS; i++) {
+    seen += stats->latency[i];
+    if (seen > 0 && seen >= rank) {
+      break;
+    }
+  }
+
+  if (i == INK_STATS_BUCKETS) {
+    return stats->latency_max_us;
+  }
+
+  /* the bucket limit may be above the largest latency seen */
+
+  return (ink_stats_bucket_limit(i) < stats->latency_max_us) ?
+    ink_stats_bucket_limit(i) : stats->latency_max_us;
+}
+
+static void add_query(struct ink_stats *stats, const int result,
+                      const struct ink_timing *timing) {
+  unsigned long long us = timing->total_ns / 1000;
+  unsigned long long max = LOAD(stats->latency_max_us);
+
+  ADD(stats->queries, 1);
+
+  if (result != OK) {
+    ADD(stats->errors, 1);
+  }
+  if (result == COULD_NOT_PARSE_RESPONSE_FROM_PRINTER) {
+    ADD(stats->protocol_errors, 1);
+  }
+
+  ADD(stats->timeouts, timing->timeouts);
+  ADD(stats->retries, timing->retries);
+  ADD(stats->reopens, timing->reopens);
+  ADD(stats->latency_sum_us, us);
+  ADD(stats->latency[bucket_of(us)], 1);
+
+  while (us > max && 
+         !__atomic_compare_exchange_n(&stats->latency_max_us, &max, us, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static int bucket_of(const unsigned long long us) {
+  int shift;
+  int bucket;
+
+  if (us < SUB_BUCKETS) {
+    return us;
+  }
+
+  shift = 63 - __builtin_clzll(us) - SUB_BITS; /* bits below the top ones */
+  bucket = (shift + 1) * SUB_BUCKETS + (int) ((us >> shift) - SUB_BUCKETS);
+
+  return (bucket < INK_STATS_BUCKETS) ? bucket : INK_STATS_BUCKETS - 1;
+}
@@ -0,0 +1,27 @@
+/* stats.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "inklevel.h"
+
+/* A query is counted with the timing collected for it, so while stats
+ * are on every query is timed, on its own thread. One that was already
+ * running when stats were turned on has no timing and is not counted.
+ * backend is an INK_BACKEND_* or -1 if it was not found out, session is
+ * NULL outside of sessions.
+ */
+
+extern int stats_enabled;
+
+void stats_record(const int backend, struct ink_stats *session, 
+                  const int result, const struct ink_timing *timing);
+void stats_snapshot(const struct ink_stats *from, struct ink_stats *to);
+
+#endif
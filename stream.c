@@ -0,0 +1,166 @@
+/* stream.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "inklevel.h"
+#include "stream.h"
+
+#define BJNP_HEADER_LENGTH 16 /* struct BJNP_command */
+
+/* local functions */
+
+static void feed_header(struct stream_parser *parser);
+static void feed_field(struct stream_parser *parser, const unsigned char c);
+static void field_done(struct stream_parser *parser);
+
+/* For STREAM_CANON, request is the command sent, e.g. "SSR=BST,CHD,CIR;".
+ * The reply is complete once all requested fields or the last of them
+ * arrived.
+ */
+
+void stream_init(struct stream_parser *parser, const int protocol,
+                 const char *request) {
+  const char *c;
+  int i;
+
+  memset(parser, 0, sizeof(struct stream_parser));
+  parser->protocol = protocol;
+
+  if (protocol == STREAM_CANON) {
+    parser->skip = 2; /* length of the reply */
+
+    if (request != NULL && (c = strchr(request, '=')) != NULL) {
+      parser->fields = 1;
+      for (i = 0; c[i] != '\0'; i++) {
+        if (c[i] == ',') {
+          parser->fields++;
+        }
+      }
+
+      if (strrchr(c, ',') != NULL) {
+        c = strrchr(c, ',');
+      }
+      c++;
+
+      for (i = 0; i < STREAM_TAG_LENGTH - 1 && c[i] != '\0' && c[i] != ';';
+           i++) {
+        parser->last_tag[i] = c[i];
+      }
+      parser->last_tag[i] = '\0';
+    }
+  } else if (protocol == STREAM_EPSON) {
+    strcpy(parser->last_tag, "IQ");
+  }
+}
+
+/* Returns 1 once the reply is complete */
+
+int stream_feed(struct stream_parser *parser, const char *data,
+                const int length) {
+  int i;
+
+  for (i = 0; i < length && !parser->complete; i++) {
+    unsigned char c = data[i];
+
+    if (parser->length < (int) sizeof(parser->header)) {
+      parser->header[parser->length] = c;
+    }
+    parser->length++;
+
+    if (parser->length <= parser->skip || parser->skip == 0) {
+      feed_header(parser);
+    } else if (parser->expected == 0) {
+      feed_field(parser, c);
+    }
+
+    if (parser->expected > 0 && parser->length >= parser->expected) {
+      parser->complete = 1;
+    }
+  }
+
+#ifdef DEBUG
+  if (parser->complete) {
+    printf("Reply complete after %d bytes\n", parser->length);
+  }
+#endif
+
+  return parser->complete;
+}
+
+static void feed_header(struct stream_parser *parser) {
+  const unsigned char *h = parser->header;
+
+  switch (parser->protocol) {
+  case STREAM_EPSON:
+    /* "@BDC ST2\r\n" is followed by two bytes of length (little endian),
+       "@BDC ST\r\n" by text */
+
+    if (parser->length == 8 && h[7] == '\r') {
+      parser->skip = 9;
+    } else if (parser->length == 12 && h[7] == '2') {
+      parser->expected = 12 + (h[10] | (h[11] << 8));
+      parser->skip = 12;
+    }
+    break;
+
+  case STREAM_BJNP:
+    /* the identity length (big endian) includes itself */
+
+    if (parser->length == BJNP_HEADER_LENGTH + 2) {
+      parser->expected = BJNP_HEADER_LENGTH +
+        ((h[BJNP_HEADER_LENGTH] << 8) | h[BJNP_HEADER_LENGTH + 1]);
+      if (parser->expected < parser->length) {
+        parser->expected = parser->length;
+      }
+      parser->skip = parser->length;
+    }
+    break;
+  }
+}
+
+/* Both Canon and the old Epson format are "TAG:value;" lists */
+
+static void feed_field(struct stream_parser *parser, const unsigned char c) {
+  if (parser->protocol == STREAM_EPSON && c == '\f') {
+    /* end of the status */
+
+    parser->complete = 1;
+    return;
+  }
+
+  if (c == ';') {
+    field_done(parser);
+  } else if (parser->in_value) {
+    return;
+  } else if (c == ':') {
+    parser->in_value = 1;
+  } else if (parser->tag_length < STREAM_TAG_LENGTH - 1) {
+    parser->tag[parser->tag_length++] = c;
+    parser->tag[parser->tag_length] = '\0';
+  }
+}
+
+static void field_done(struct stream_parser *parser) {
+  if (parser->in_value) {
+    if (parser->protocol == STREAM_CANON && --parser->fields <= 0) {
+      parser->complete = 1;
+    }
+
+    if (strcmp(parser->tag, parser->last_tag) == 0) {
+      parser->complete = 1;
+    }
+  }
+
+  parser->tag[0] = '\0';
+  parser->tag_length = 0;
+  parser->in_value = 0;
+}
@@ -0,0 +1,47 @@
+/* stream.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+/* Values for protocol */
+
+#define STREAM_CANON 1 /* length, "TAG:value;" for every requested field */
+#define STREAM_EPSON 2 /* "@BDC ST2\r\n" with length or "@BDC ST\r\n" text */
+#define STREAM_BJNP 3  /* BJNP header, identity length, identity */
+
+#define STREAM_TAG_LENGTH 8
+
+/* How long to wait for the rest of a reply once it started, in ms */
+
+#define STREAM_GAP 200
+
+/* Is fed the bytes of a reply as they arrive and tells when the reply is
+ * complete, so that reading can stop right then
+ */
+
+struct stream_parser {
+  int protocol;
+  int length;       /* bytes fed so far */
+  int expected;     /* length of the whole reply once known, else 0 */
+  int complete;
+  int skip;         /* bytes before the first field */
+  int fields;       /* fields still expected (Canon) */
+  char last_tag[STREAM_TAG_LENGTH]; /* field that completes the reply */
+  char tag[STREAM_TAG_LENGTH];      /* field being read */
+  int tag_length;
+  int in_value;
+  unsigned char header[20];
+};
+
+void stream_init(struct stream_parser *parser, const int protocol,
+                 const char *request);
+int stream_feed(struct stream_parser *parser, const char *data,
+                const int length);
+
+#endif
@@ -0,0 +1,89 @@
+/* timing.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "inklevel.h"
+#include "timing.h"
+
+#define TIMING_DEPTH 8
+
+/* Every thread times its own query, queries on other threads neither see
+ * nor disturb it
+ */
+
+__thread struct ink_timing *current_timing = NULL;
+
+static __thread int stages[TIMING_DEPTH]; /* begun and not yet ended */
+static __thread int depth = 0;
+static __thread unsigned long long started;
+static __thread unsigned long long mark;  /* since then the top stage runs */
+
+/* local functions */
+
+static unsigned long long now(void);
+static void charge(const unsigned long long t);
+
+void timing_start(struct ink_timing *timing) {
+  memset(timing, 0, sizeof(struct ink_timing));
+  current_timing = timing;
+  depth = 0;
+  started = mark = now();
+}
+
+void timing_stop(void) {
+  if (current_timing != NULL) {
+    current_timing->total_ns = now() - started;
+    current_timing = NULL;
+  }
+}
+
+void timing_begin(const int stage) {
+  unsigned long long t = now();
+
+  charge(t);
+
+  if (depth < TIMING_DEPTH) {
+    stages[depth] = stage;
+  }
+  depth++;
+  mark = t;
+}
+
+void timing_end(void) {
+  unsigned long long t = now();
+
+  if (depth > 0) {
+    charge(t);
+    depth--;
+  }
+  mark = t;
+}
+
+static unsigned long long now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Adds the time since mark to the running stage, stages nested too deep
+ * count for the deepest one known
+ */
+
+static void charge(const unsigned long long t) {
+  int top = (depth < TIMING_DEPTH) ? depth : TIMING_DEPTH;
+
+  if (top > 0 && current_timing != NULL) {
+    current_timing->stage_ns[stages[top - 1]] += t - mark;
+  }
+}
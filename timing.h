@@ -0,0 +1,54 @@
+/* timing.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include "inklevel.h"
+#include "trace.h"
+
+/* Where the time of a query goes. Only if the caller asked for it,
+ * current_timing is not NULL, otherwise the macros cost one test. The
+ * state is per thread, so concurrent queries are timed separately.
+ * Stages may nest, the time of a nested stage is only counted there.
+ * While a trace is recorded, the stages are events of it too.
+ */
+
+extern __thread struct ink_timing *current_timing;
+
+void timing_start(struct ink_timing *timing);
+void timing_stop(void);
+void timing_begin(const int stage);
+void timing_end(void);
+
+#define TIMING_BEGIN(stage) \
+  do { if (current_timing != NULL) timing_begin(stage); \
+    TRACE_BEGIN(stage, TRACE_ARG_NONE, 0); } while (0)
+
+#define TIMING_END() \
+  do { if (current_timing != NULL) timing_end(); \
+    TRACE_END(TRACE_ARG_NONE, 0); } while (0)
+
+#define TIMING_RETRY() \
+  do { if (current_timing != NULL) current_timing->retries++; } while (0)
+
+#define TIMING_TIMEOUT() \
+  do { if (current_timing != NULL) current_timing->timeouts++; } while (0)
+
+#define TIMING_REOPEN() \
+  do { if (current_timing != NULL) current_timing->reopens++; } while (0)
+
+#define TIMING_BYTES_IN(n) \
+  do { if (current_timing != NULL && (n) > 0) \
+      current_timing->bytes_in += (n); } while (0)
+
+#define TIMING_BYTES_OUT(n) \
+  do { if (current_timing != NULL && (n) > 0) \
+      current_timing->bytes_out += (n); } while (0)
+
+#endif
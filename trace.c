@@ -0,0 +1,181 @@
+/* trace.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "inklevel.h"
+#include "trace.h"
+
+/* Events are taken from the buffer by an atomic increment, so queries in
+ * several threads can record at the same time. phase is set last, an
+ * event without one is still being filled in.
+ */
+
+struct trace_event {
+  unsigned long long ns;  /* since ink_trace_start() */
+  unsigned int tid;
+  unsigned short name;    /* INK_STAGE_* or TRACE_* */
+  unsigned char arg_name; /* TRACE_ARG_* */
+  char phase;             /* 'B', 'E' or 'i' as in the JSON */
+  int arg;
+};
+
+int trace_enabled = 0;
+
+static struct trace_event *events = NULL;
+static unsigned int capacity = 0;
+static unsigned int used = 0;
+static unsigned int dropped = 0;
+static unsigned long long started;
+
+static const char *const names[TRACE_NAMES] = {
+  "open", "device id", "resolve", "exchange", "d4", "parse",
+  "query", "bjnp send", "bjnp recv", "d4 transaction"
+};
+
+static const char *const arg_names[] = {
+  NULL, "port", "result", "seq_no", "command"
+};
+
+/* local functions */
+
+static unsigned long long now(void);
+static unsigned int thread_id(void);
+
+int ink_trace_start(const unsigned int max_events) {
+  trace_enabled = 0;
+
+  if (events == NULL || capacity < max_events) {
+    free(events);
+    capacity = 0;
+
+    if ((events = malloc(max_events * sizeof(struct trace_event))) == NULL) {
+      return ERROR;
+    }
+    capacity = max_events;
+  }
+
+  memset(events, 0, capacity * sizeof(struct trace_event));
+  used = 0;
+  dropped = 0;
+  started = now();
+
+  __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+  return OK;
+}
+
+void ink_trace_stop(void) {
+  trace_enabled = 0;
+}
+
+/* Writes the events in the Trace Event Format read by Perfetto and
+ * chrome://tracing. Returns the number of events written.
+ */
+
+int ink_trace_save(const char *filename) {
+  const struct trace_event *event;
+  unsigned int count;
+  unsigned int i;
+  FILE *file;
+  int pid = getpid();
+  int written = 0;
+
+  if ((file = fopen(filename, "w")) == NULL) {
+    return ERROR;
+  }
+
+  count = __atomic_load_n(&used, __ATOMIC_RELAXED);
+  count = (count < capacity) ? count : capacity;
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%u},"
+          "\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"libinklevel\"}}",
+          __atomic_load_n(&dropped, __ATOMIC_RELAXED), pid);
+
+  for (i = 0; i < count; i++) {
+    event = &events[i];
+
+    if (__atomic_load_n(&event->phase, __ATOMIC_ACQUIRE) == 0) {
+      continue;
+    }
+
+    fprintf(file, ",\n{\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%u",
+            event->phase, event->ns / 1000, (unsigned int) (event->ns % 1000),
+            pid, event->tid);
+
+    if (event->name < TRACE_NAMES) {
+      fprintf(file, ",\"name\":\"%s\"", names[event->name]);
+    }
+    if (event->phase == 'i') {
+      fprintf(file, ",\"s\":\"t\"");
+    }
+    if (event->arg_name != TRACE_ARG_NONE) {
+      fprintf(file, ",\"args\":{\"%s\":%d}", arg_names[event->arg_name],
+              event->arg);
+    }
+
+    fprintf(file, "}");
+    written++;
+  }
+
+  fprintf(file, "\n]}\n");
+
+  if (fclose(file) != 0) {
+    return ERROR;
+  }
+
+  return written;
+}
+
+void trace_event(const int name, const char phase, const int arg_name,
+                 const int arg) {
+  struct trace_event *event;
+  unsigned int i;
+
+  if ((i = __atomic_fetch_add(&used, 1, __ATOMIC_RELAXED)) >= capacity) {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  event = &events[i];
+  event->ns = now() - started;
+  event->tid = thread_id();
+  event->name = name;
+  event->arg_name = arg_name;
+  event->arg = arg;
+
+  __atomic_store_n(&event->phase, phase, __ATOMIC_RELEASE);
+}
+
+static unsigned long long now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int thread_id(void) {
+#ifdef SYS_gettid
+  return syscall(SYS_gettid);
+#else
+  return (unsigned int) (unsigned long) pthread_self();
+#endif
+}
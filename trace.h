@@ -0,0 +1,49 @@
+/* trace.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "inklevel.h"
+
+/* Events of ink_trace_start(). The stages of timing.h are traced with
+ * their INK_STAGE_* as name, these follow them.
+ */
+
+#define TRACE_QUERY INK_STAGES
+#define TRACE_BJNP_SEND (INK_STAGES + 1)
+#define TRACE_BJNP_RECV (INK_STAGES + 2)
+#define TRACE_D4_TRANSACTION (INK_STAGES + 3)
+#define TRACE_NAMES (INK_STAGES + 4)
+
+/* What the argument of an event is */
+
+#define TRACE_ARG_NONE 0
+#define TRACE_ARG_PORT 1
+#define TRACE_ARG_RESULT 2
+#define TRACE_ARG_SEQ_NO 3
+#define TRACE_ARG_COMMAND 4
+
+extern int trace_enabled;
+
+void trace_event(const int name, const char phase, const int arg_name,
+                 const int arg);
+
+#define TRACE_BEGIN(name, arg_name, arg) \
+  do { if (trace_enabled) trace_event(name, 'B', arg_name, arg); } while (0)
+
+/* Ends the event begun last in the thread */
+
+#define TRACE_END(arg_name, arg) \
+  do { if (trace_enabled) trace_event(TRACE_NAMES, 'E', arg_name, arg); \
+  } while (0)
+
+#define TRACE_INSTANT(name, arg_name, arg) \
+  do { if (trace_enabled) trace_event(name, 'i', arg_name, arg); } while (0)
+
+#endif
@@ -0,0 +1,493 @@
+/* transcript.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "inklevel.h"
+#include "transport.h"
+
+#define TRANSCRIPT_MAGIC 0x544b4e49 /* "INKT" */
+#define TRANSCRIPT_VERSION 1
+
+/* Values for transcript_record.op, one for each call of a transport */
+
+#define TRANSCRIPT_OPEN 1
+#define TRANSCRIPT_READ 2
+#define TRANSCRIPT_WRITE 3
+#define TRANSCRIPT_CLOSE 4
+#define TRANSCRIPT_DEVICE_ID 5
+#define TRANSCRIPT_DGRAM_OPEN 6
+#define TRANSCRIPT_DGRAM_SEND 7
+#define TRANSCRIPT_DGRAM_RECV 8
+
+/* A transcript file is a struct transcript_header followed by a record
+ * for every call, each followed by length bytes of data: the device name
+ * for open, the struct sockaddr_in for dgram_open, the bytes read or
+ * written and the device id with its terminating 0. All numbers are in
+ * host byte order.
+ */
+
+struct transcript_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+};
+
+struct transcript_record {
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t error;    /* errno if result < 0 */
+  int32_t handle;    /* -1 for open and dgram_open */
+  int32_t result;
+  uint32_t duration; /* microseconds */
+  uint32_t length;
+};
+
+struct transcript {
+  const struct ink_transport *recorded; /* NULL when replaying */
+  FILE *file;
+  int failed;           /* a write failed or the replay went astray */
+  unsigned char *data;  /* the whole file when replaying */
+  size_t size;
+  size_t position;
+  int flags;
+  pthread_mutex_t lock;
+};
+
+/* local functions */
+
+static unsigned long long now(void);
+static struct transcript *transcript_new(struct ink_transport *transport);
+static void record(struct transcript *t, const int op, const int handle,
+                   const int result, const unsigned long long start,
+                   const void *data, const int length);
+static int record_open(void *data, const char *device, const int flags);
+static int record_read(void *data, const int handle, void *buffer,
+                       const int length, const int timeout);
+static int record_write(void *data, const int handle, const void *buffer,
+                        const int length);
+static void record_close(void *data, const int handle);
+static int record_device_id(void *data, const int handle, char *buffer,
+                            const int length);
+static int record_dgram_open(void *data, const struct sockaddr_in *address);
+static int record_dgram_send(void *data, const int handle,
+                             const void *buffer, const int length);
+static int record_dgram_recv(void *data, const int handle, void *buffer,
+                             const int length, const int timeout);
+static int replay(struct transcript *t, const int op, const int handle,
+                  void *buffer, const void *sent, const int length);
+static int replay_open(void *data, const char *device, const int flags);
+static int replay_read(void *data, const int handle, void *buffer,
+                       const int length, const int timeout);
+static int replay_write(void *data, const int handle, const void *buffer,
+                        const int length);
+static void replay_close(void *data, const int handle);
+static int replay_device_id(void *data, const int handle, char *buffer,
+                            const int length);
+static int replay_dgram_open(void *data, const struct sockaddr_in *address);
+static int replay_dgram_send(void *data, const int handle,
+                             const void *buffer, const int length);
+static int replay_dgram_recv(void *data, const int handle, void *buffer,
+                             const int length, const int timeout);
+
+int ink_record_transport(struct ink_transport *transport,
+                         const struct ink_transport *recorded,
+                         const char *filename) {
+  struct transcript_header header;
+  struct transcript *t;
+
+  if ((t = transcript_new(transport)) == NULL) {
+    return ERROR;
+  }
+
+  t->recorded = (recorded != NULL) ? recorded : transport_default();
+
+  header.magic = TRANSCRIPT_MAGIC;
+  header.version = TRANSCRIPT_VERSION;
+  header.reserved = 0;
+
+  if ((t->file = fopen(filename, "wb")) == NULL ||
+      fwrite(&header, sizeof(header), 1, t->file) != 1) {
+    ink_close_transcript(transport);
+    return ERROR;
+  }
+
+  transport->open = record_open;
+  transport->read = record_read;
+  transport->write = record_write;
+  transport->close = record_close;
+  transport->device_id = record_device_id;
+  transport->dgram_open = record_dgram_open;
+  transport->dgram_send = record_dgram_send;
+  transport->dgram_recv = record_dgram_recv;
+
+  return OK;
+}
+
+int ink_replay_transport(struct ink_transport *transport,
+                         const char *filename, const int flags) {
+  struct transcript_header header;
+  struct transcript *t;
+  FILE *file;
+  long size;
+
+  if ((t = transcript_new(transport)) == NULL) {
+    return ERROR;
+  }
+
+  t->flags = flags;
+
+  if ((file = fopen(filename, "rb")) == NULL) {
+    ink_close_transcript(transport);
+    return ERROR;
+  }
+
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+      (size_t) size < sizeof(header) || fseek(file, 0, SEEK_SET) != 0 ||
+      (t->data = malloc(size)) == NULL ||
+      fread(t->data, size, 1, file) != 1) {
+    fclose(file);
+    ink_close_transcript(transport);
+    return ERROR;
+  }
+
+  fclose(file);
+
+  memcpy(&header, t->data, sizeof(header));
+
+  if (header.magic != TRANSCRIPT_MAGIC ||
+      header.version != TRANSCRIPT_VERSION) {
+    ink_close_transcript(transport);
+    return ERROR;
+  }
+
+  t->size = size;
+  t->position = sizeof(header);
+
+  transport->open = replay_open;
+  transport->read = replay_read;
+  transport->write = replay_write;
+  transport->close = replay_close;
+  transport->device_id = replay_device_id;
+  transport->dgram_open = replay_dgram_open;
+  transport->dgram_send = replay_dgram_send;
+  transport->dgram_recv = replay_dgram_recv;
+
+  return OK;
+}
+
+/* Starts the replay over, e.g. to run a transcript repeatedly */
+
+void ink_rewind_transcript(struct ink_transport *transport) {
+  struct transcript *t = transport->data;
+
+  pthread_mutex_lock(&t->lock);
+  t->position = sizeof(struct transcript_header);
+  t->failed = 0;
+  pthread_mutex_unlock(&t->lock);
+}
+
+int ink_close_transcript(struct ink_transport *transport) {
+  struct transcript *t = transport->data;
+  int failed;
+
+  if (t == NULL) {
+    return ERROR;
+  }
+
+  failed = t->failed && t->recorded != NULL;
+
+  if (t->file != NULL && fclose(t->file) != 0) {
+    failed = 1;
+  }
+
+  pthread_mutex_destroy(&t->lock);
+  free(t->data);
+  free(t);
+  transport->data = NULL;
+
+  return failed ? ERROR : OK;
+}
+
+static unsigned long long now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static struct transcript *transcript_new(struct ink_transport *transport) {
+  struct transcript *t;
+
+  memset(transport, 0, sizeof(struct ink_transport));
+
+  if ((t = calloc(1, sizeof(struct transcript))) == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&t->lock, NULL);
+  transport->data = t;
+
+  return t;
+}
+
+/* Appends a call to the transcript. Calls from several threads are kept
+ * whole but may be in any order, a transcript to be replayed should be
+ * recorded with one query at a time.
+ */
+
+static void record(struct transcript *t, const int op, const int handle,
+                   const int result, const unsigned long long start,
+                   const void *data, const int length) {
+  struct transcript_record r;
+  int saved_errno = errno;
+
+  memset(&r, 0, sizeof(r));
+  r.op = op;
+  r.error = (result < 0) ? saved_errno : 0;
+  r.handle = handle;
+  r.result = result;
+  r.duration = now() - start;
+  r.length = (length > 0) ? length : 0;
+
+  pthread_mutex_lock(&t->lock);
+
+  if (fwrite(&r, sizeof(r), 1, t->file) != 1 ||
+      (r.length > 0 && fwrite(data, r.length, 1, t->file) != 1)) {
+    t->failed = 1;
+  }
+
+  pthread_mutex_unlock(&t->lock);
+
+  errno = saved_errno;
+}
+
+static int record_open(void *data, const char *device, const int flags) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->open(t->recorded->data, device, flags);
+
+  record(t, TRANSCRIPT_OPEN, -1, result, start, device, strlen(device));
+
+  return result;
+}
+
+static int record_read(void *data, const int handle, void *buffer,
+                       const int length, const int timeout) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->read(t->recorded->data, handle, buffer, length,
+                                 timeout);
+
+  record(t, TRANSCRIPT_READ, handle, result, start, buffer, result);
+
+  return result;
+}
+
+static int record_write(void *data, const int handle, const void *buffer,
+                        const int length) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->write(t->recorded->data, handle, buffer, length);
+
+  record(t, TRANSCRIPT_WRITE, handle, result, start, buffer, result);
+
+  return result;
+}
+
+static void record_close(void *data, const int handle) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+
+  t->recorded->close(t->recorded->data, handle);
+
+  record(t, TRANSCRIPT_CLOSE, handle, 0, start, NULL, 0);
+}
+
+static int record_device_id(void *data, const int handle, char *buffer,
+                            const int length) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->device_id(t->recorded->data, handle, buffer,
+                                      length);
+
+  record(t, TRANSCRIPT_DEVICE_ID, handle, result, start, buffer,
+         (result >= 0) ? (int) strlen(buffer) + 1 : 0);
+
+  return result;
+}
+
+static int record_dgram_open(void *data, const struct sockaddr_in *address) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->dgram_open(t->recorded->data, address);
+
+  record(t, TRANSCRIPT_DGRAM_OPEN, -1, result, start, address,
+         sizeof(struct sockaddr_in));
+
+  return result;
+}
+
+static int record_dgram_send(void *data, const int handle,
+                             const void *buffer, const int length) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->dgram_send(t->recorded->data, handle, buffer,
+                                       length);
+
+  record(t, TRANSCRIPT_DGRAM_SEND, handle, result, start, buffer, result);
+
+  return result;
+}
+
+static int record_dgram_recv(void *data, const int handle, void *buffer,
+                             const int length, const int timeout) {
+  struct transcript *t = data;
+  unsigned long long start = now();
+  int result = t->recorded->dgram_recv(t->recorded->data, handle, buffer,
+                                       length, timeout);
+
+  record(t, TRANSCRIPT_DGRAM_RECV, handle, result, start, buffer, result);
+
+  return result;
+}
+
+/* Takes the next call from the transcript, which has to be op on handle,
+ * any handle if -1. If sent is not NULL, its length bytes have to begin
+ * with the data of the call, the bytes that were written. Otherwise up
+ * to length bytes of the data are copied to buffer. Returns the result
+ * of the call, or the number of bytes copied if that is less.
+ */
+
+static int replay(struct transcript *t, const int op, const int handle,
+                  void *buffer, const void *sent, const int length) {
+  struct transcript_record r;
+  struct timespec ts;
+  int result;
+  int n;
+
+  pthread_mutex_lock(&t->lock);
+
+  if (!t->failed && t->position + sizeof(r) <= t->size) {
+    memcpy(&r, t->data + t->position, sizeof(r));
+
+    if (r.op != op || (handle != -1 && r.handle != handle) ||
+        r.length > t->size - t->position - sizeof(r)) {
+      t->failed = 1;
+    } else if (sent != NULL && 
+               ((int) r.length > length ||
+                memcmp(sent, t->data + t->position + sizeof(r), 
+                       r.length) != 0)) {
+      t->failed = 1;
+    }
+  } else {
+    t->failed = 1;
+  }
+
+  if (t->failed) {
+
+#ifdef DEBUG
+    printf("Replay went astray at offset %lu, call %d on handle %d\n",
+           (unsigned long) t->position, op, handle);
+#endif
+
+    pthread_mutex_unlock(&t->lock);
+    errno = EIO;
+    return -1;
+  }
+
+  n = ((int) r.length < length) ? (int) r.length : length;
+
+  if (buffer != NULL && n > 0) {
+    memcpy(buffer, t->data + t->position + sizeof(r), n);
+  }
+
+  t->position += sizeof(r) + r.length;
+
+  pthread_mutex_unlock(&t->lock);
+
+  if (t->flags & INK_REPLAY_TIMED) {
+    ts.tv_sec = r.duration / 1000000;
+    ts.tv_nsec = (r.duration % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+  }
+
+  result = (r.result > 0 && n < r.result && buffer != NULL) ? n : r.result;
+
+  if (result < 0) {
+    errno = r.error;
+  }
+
+  return result;
+}
+
+static int replay_open(void *data, const char *device, const int flags) {
+  (void) device;
+  (void) flags;
+
+  return replay(data, TRANSCRIPT_OPEN, -1, NULL, NULL, 0);
+}
+
+static int replay_read(void *data, const int handle, void *buffer,
+                       const int length, const int timeout) {
+  (void) timeout;
+
+  return replay(data, TRANSCRIPT_READ, handle, buffer, NULL, length);
+}
+
+static int replay_write(void *data, const int handle, const void *buffer,
+                        const int length) {
+  return replay(data, TRANSCRIPT_WRITE, handle, NULL, buffer, length);
+}
+
+static void replay_close(void *data, const int handle) {
+  replay(data, TRANSCRIPT_CLOSE, handle, NULL, NULL, 0);
+}
+
+static int replay_device_id(void *data, const int handle, char *buffer,
+                            const int length) {
+  int result = replay(data, TRANSCRIPT_DEVICE_ID, handle, buffer, NULL,
+                      length);
+
+  if (length > 0) {
+    buffer[length - 1] = '\0';
+  }
+
+  return result;
+}
+
+static int replay_dgram_open(void *data, const struct sockaddr_in *address) {
+  (void) address;
+
+  return replay(data, TRANSCRIPT_DGRAM_OPEN, -1, NULL, NULL, 0);
+}
+
+static int replay_dgram_send(void *data, const int handle,
+                             const void *buffer, const int length) {
+  return replay(data, TRANSCRIPT_DGRAM_SEND, handle, NULL, buffer, length);
+}
+
+static int replay_dgram_recv(void *data, const int handle, void *buffer,
+                             const int length, const int timeout) {
+  (void) timeout;
+
+  return replay(data, TRANSCRIPT_DGRAM_RECV, handle, buffer, NULL,
+                length);
+}
@@ -0,0 +1,315 @@
+/* transport.c
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "internal.h"
+#include "inklevel.h"
+#include "platform_specific.h"
+#include "transport.h"
+
+#define MAX_MEMORY_HANDLES 16
+#define ADDRESS_LENGTH 32 /* "a.b.c.d:port" */
+
+/* An open device of the memory transport and the reply it has queued */
+
+struct memory_handle {
+  const struct ink_memory_device *device; /* NULL if not in use */
+  const char *reply;
+  int remaining;
+};
+
+/* local functions */
+
+static int fd_open(void *data, const char *device, const int flags);
+static int fd_read(void *data, const int handle, void *buffer,
+                   const int length, const int timeout);
+static int fd_write(void *data, const int handle, const void *buffer,
+                    const int length);
+static void fd_close(void *data, const int handle);
+static int fd_device_id(void *data, const int handle, char *buffer,
+                        const int length);
+static int socket_open(void *data, const struct sockaddr_in *address);
+static int socket_send(void *data, const int handle, const void *buffer,
+                       const int length);
+static int memory_find(const struct ink_memory_device *devices,
+                       const char *name);
+static int memory_open(void *data, const char *device, const int flags);
+static int memory_read(void *data, const int handle, void *buffer,
+                       const int length, const int timeout);
+static int memory_write(void *data, const int handle, const void *buffer,
+                        const int length);
+static void memory_close(void *data, const int handle);
+static int memory_device_id(void *data, const int handle, char *buffer,
+                            const int length);
+static int memory_dgram_open(void *data, const struct sockaddr_in *address);
+
+static const struct ink_transport fd_transport = {
+  fd_open, fd_read, fd_write, fd_close, fd_device_id,
+  socket_open, socket_send, fd_read, NULL
+};
+
+static const struct ink_transport *transport = &fd_transport;
+static struct memory_handle memory_handles[MAX_MEMORY_HANDLES];
+
+void set_ink_transport(const struct ink_transport *new_transport) {
+  transport = (new_transport != NULL) ? new_transport : &fd_transport;
+}
+
+const struct ink_transport *transport_default(void) {
+  return &fd_transport;
+}
+
+int transport_is_fd(void) {
+  return transport == &fd_transport;
+}
+
+int transport_open(const char *device, const int flags) {
+  return transport->open(transport->data, device, flags);
+}
+
+int transport_read(const int handle, void *buffer, const int length,
+                   const int timeout) {
+  return transport->read(transport->data, handle, buffer, length, timeout);
+}
+
+int transport_write(const int handle, const void *buffer, const int length) {
+  return transport->write(transport->data, handle, buffer, length);
+}
+
+void transport_close(const int handle) {
+  transport->close(transport->data, handle);
+}
+
+int transport_device_id(const int handle, char *buffer, const int length) {
+  return transport->device_id(transport->data, handle, buffer, length);
+}
+
+int transport_dgram_open(const struct sockaddr_in *address) {
+  return transport->dgram_open(transport->data, address);
+}
+
+int transport_dgram_send(const int handle, const void *buffer,
+                         const int length) {
+  return transport->dgram_send(transport->data, handle, buffer, length);
+}
+
+int transport_dgram_recv(const int handle, void *buffer, const int length,
+                         const int timeout) {
+  return transport->dgram_recv(transport->data, handle, buffer, length,
+                               timeout);
+}
+
+/* The default transport, device files and UDP sockets */
+
+static int fd_open(void *data, const char *device, const int flags) {
+  (void) data;
+
+  return open(device, flags | O_CLOEXEC);
+}
+
+static int fd_read(void *data, const int handle, void *buffer,
+                   const int length, const int timeout) {
+  struct pollfd ufds;
+  int status;
+
+  (void) data;
+
+  if (timeout == TRANSPORT_WAIT) {
+    return read(handle, buffer, length);
+  }
+
+  ufds.fd = handle;
+  ufds.events = POLLIN;
+  ufds.revents = 0;
+
+  if ((status = poll(&ufds, 1, timeout)) <= 0) {
+    return (status < 0 && errno == EINTR) ? 0 : status;
+  }
+
+  status = read(handle, buffer, length);
+
+  return (status < 0 && errno == EAGAIN) ? 0 : status;
+}
+
+static int fd_write(void *data, const int handle, const void *buffer,
+                    const int length) {
+  (void) data;
+
+  return write(handle, buffer, length);
+}
+
+static void fd_close(void *data, const int handle) {
+  (void) data;
+
+  close(handle);
+}
+
+static int fd_device_id(void *data, const int handle, char *buffer,
+                        const int length) {
+  (void) data;
+
+  return get_device_id_fd(handle, buffer, length);
+}
+
+static int socket_open(void *data, const struct sockaddr_in *address) {
+  int fd;
+
+  (void) data;
+
+  if ((fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    return -1;
+  }
+
+  if (connect(fd, (const struct sockaddr *) address,
+              sizeof(struct sockaddr_in)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int socket_send(void *data, const int handle, const void *buffer,
+                       const int length) {
+  (void) data;
+
+  return send(handle, buffer, length, 0);
+}
+
+/* The memory transport answers from a table instead of a printer. A
+ * write starting with the command of an exchange queues its reply, reads
+ * return what is queued and never wait. Like the library itself, it may
+ * only be used by one thread at a time.
+ */
+
+void ink_memory_transport(struct ink_transport *new_transport,
+                          const struct ink_memory_device *devices) {
+  new_transport->open = memory_open;
+  new_transport->read = memory_read;
+  new_transport->write = memory_write;
+  new_transport->close = memory_close;
+  new_transport->device_id = memory_device_id;
+  new_transport->dgram_open = memory_dgram_open;
+  new_transport->dgram_send = memory_write;
+  new_transport->dgram_recv = memory_read;
+  new_transport->data = (void *) devices;
+}
+
+static int memory_find(const struct ink_memory_device *devices,
+                       const char *name) {
+  int handle;
+  int i;
+
+  for (i = 0; devices[i].name != NULL; i++) {
+    if (strcmp(devices[i].name, name) == 0) {
+      break;
+    }
+  }
+
+  if (devices[i].name == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  for (handle = 0; handle < MAX_MEMORY_HANDLES; handle++) {
+    if (memory_handles[handle].device == NULL) {
+      memory_handles[handle].device = &devices[i];
+      memory_handles[handle].remaining = 0;
+      return handle;
+    }
+  }
+
+  errno = EMFILE;
+  return -1;
+}
+
+static int memory_open(void *data, const char *device, const int flags) {
+  (void) flags;
+
+  return memory_find(data, device);
+}
+
+static int memory_read(void *data, const int handle, void *buffer,
+                       const int length, const int timeout) {
+  struct memory_handle *h = &memory_handles[handle];
+  int n = (h->remaining < length) ? h->remaining : length;
+
+  (void) data;
+  (void) timeout;
+
+  memcpy(buffer, h->reply, n);
+  h->reply += n;
+  h->remaining -= n;
+
+  return n;
+}
+
+static int memory_write(void *data, const int handle, const void *buffer,
+                        const int length) {
+  struct memory_handle *h = &memory_handles[handle];
+  const struct ink_memory_exchange *ex;
+  int i;
+
+  (void) data;
+
+  for (i = 0; i < h->device->num_exchanges; i++) {
+    ex = &h->device->exchanges[i];
+
+    if (ex->command_length <= length &&
+        memcmp(ex->command, buffer, ex->command_length) == 0) {
+      h->reply = ex->reply;
+      h->remaining = ex->reply_length;
+      break;
+    }
+  }
+
+  return length;
+}
+
+static void memory_close(void *data, const int handle) {
+  (void) data;
+
+  memory_handles[handle].device = NULL;
+}
+
+static int memory_device_id(void *data, const int handle, char *buffer,
+                            const int length) {
+  const char *device_id = memory_handles[handle].device->device_id;
+
+  (void) data;
+
+  if (device_id == NULL) {
+    return -1;
+  }
+
+  strncpy(buffer, device_id, length - 1);
+  buffer[length - 1] = '\0';
+
+  return strlen(buffer);
+}
+
+static int memory_dgram_open(void *data, const struct sockaddr_in *address) {
+  char name[ADDRESS_LENGTH];
+
+  snprintf(name, sizeof(name), "%s:%d", inet_ntoa(address->sin_addr),
+           ntohs(address->sin_port));
+
+  return memory_find(data, name);
+}
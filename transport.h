@@ -0,0 +1,38 @@
+/* transport.h
+ *
+ * (c) 2026 Markus Heinz
+ *
+ * This software is licensed under the terms of the GPL.
+ * For details see file COPYING.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <netinet/in.h>
+
+#include "inklevel.h"
+
+/* All I/O with printers goes through these, to the transport set with
+ * set_ink_transport(). Handles are file descriptors only with the default
+ * transport, transport_is_fd() tells whether poll() and friends may be
+ * used on them.
+ */
+
+#define TRANSPORT_WAIT -1 /* timeout of a read that waits until interrupted */
+
+const struct ink_transport *transport_default(void);
+int transport_is_fd(void);
+int transport_open(const char *device, const int flags);
+int transport_read(const int handle, void *buffer, const int length,
+                   const int timeout);
+int transport_write(const int handle, const void *buffer, const int length);
+void transport_close(const int handle);
+int transport_device_id(const int handle, char *buffer, const int length);
+int transport_dgram_open(const struct sockaddr_in *address);
+int transport_dgram_send(const int handle, const void *buffer,
+                         const int length);
+int transport_dgram_recv(const int handle, void *buffer, const int length,
+                         const int timeout);
+
+#endif
@@ -10,40 +10,44 @@
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/poll.h>
 #include <string.h>
 #include <errno.h>
 
 #include "internal.h"
 #include "inklevel.h"
 #include "util.h"
+#include "timing.h"
+#include "transport.h"
+
+/* local functions */
+
+static int set_nonblocking(const int fd, const int nonblocking);
+static void restore_flags(const int fd, const int flags);
 
 /* This function reads from the printer nonblockingly */
 int read_from_printer(int fd, void *buf, size_t bufsize, int nonblocking) {
   int status;
   int retry = 10;
-  struct pollfd ufds;
+  int flags;
 
   memset(buf, 0, bufsize);
 
-  if (nonblocking) {
-    fcntl(fd, F_SETFL, O_NONBLOCK | fcntl(fd, F_GETFL));
-  }
+  flags = set_nonblocking(fd, nonblocking);
 
   do {
-    ufds.fd = fd;
-    ufds.events = POLLIN;
-    ufds.revents = 0;
-    if ((status = poll(&ufds, 1, 1000)) < 0) {
-      break;
-    }
-    status = read(fd, buf, bufsize - 1);
-    if ((status == 0) || ((status < 0) && (errno == EAGAIN))) {
+    status = transport_read(fd, buf, bufsize - 1, 1000);
+    TIMING_BYTES_IN(status);
+    if (status == 0) {
       usleep(2000);
-      status = 0;
     }
   } while ((status == 0) && (--retry != 0));
 
+  restore_flags(fd, flags);
+
+  if (status == 0) {
+    TIMING_TIMEOUT();
+  }
+
 #ifdef DEBUG
   if ((status == 0) && (retry == 0)) {
     printf("Read from printer timed out\n");
@@ -55,240 +59,66 @@ int read_from_printer(int fd, void *buf, size_t bufsize, int nonblocking) {
   return status;
 }
 
-
-/* This function converts a string containing a two digit hexadecimal number
- * to an int 
+/* This function reads a reply from the printer until the parser says it
+ * is complete. Once the reply started, the rest has to follow within
+ * STREAM_GAP milliseconds.
  */
+int read_reply_from_printer(int fd, void *buf, size_t bufsize, int nonblocking,
+                            struct stream_parser *parser) {
+  char *c = buf;
+  int length = 0;
+  int status;
+  int retry = 10;
+  int flags;
 
-int my_axtoi(char* t) {
-  int r = 0;
-
-  switch (t[0]) {
-  case '0':
-    r = 0;
-    break;
-  case '1':
-    r = 16;
-    break;
-  case '2':
-    r = 32;
-    break;
-  case '3':
-    r = 48;
-    break;
-  case '4':
-    r = 64;
-    break;
-  case '5':
-    r = 80;
-    break;
-  case '6':
-    r = 96;
-    break;
-  case '7':
-    r = 112;
-    break;
-  case '8':
-    r = 128;
-    break;
-  case '9':
-    r = 144;
-    break;
-  case 'a':
-  case 'A':
-    r = 160;
-    break;
-  case 'b':
-  case 'B':
-    r = 176;
-    break;
-  case 'c':
-  case 'C':
-    r = 192;
-    break;
-  case 'd':
-  case 'D':
-    r = 208;
-    break;
-  case 'e':
-  case 'E':
-    r = 224;
-    break;
-  case 'f':
-  case 'F':
-    r = 240;
-    break;
-  }
-
-  switch (t[1]) {
-  case '0':
-    r += 0;
-    break;
-  case '1':
-    r += 1;
-    break;
-  case '2':
-    r += 2;
-    break;
-  case '3':
-    r += 3;
-    break;
-  case '4':
-    r += 4;
-    break;
-  case '5':
-    r += 5;
-    break;
-  case '6':
-    r += 6;
-    break;
-  case '7':
-    r += 7;
-    break;
-  case '8':
-    r += 8;
-    break;
-  case '9':
-    r += 9;
-    break;
-  case 'a':
-  case 'A':
-    r += 10;
-    break;
-  case 'b':
-  case 'B':
-    r += 11;
-    break;
-  case 'c':
-  case 'C':
-    r += 12;
-    break;
-  case 'd':
-  case 'D':
-    r += 13;
-    break;
-  case 'e':
-  case 'E':
-    r += 14;
-    break;
-  case 'f':
-  case 'F':
-    r += 15;
-    break;
-  }
+  memset(buf, 0, bufsize);
 
-  return r;
-}
+  flags = set_nonblocking(fd, nonblocking);
 
-/* This function converts a string containig a three digit decimal number
- * to an int 
- */
+  while ((length < (int) bufsize - 1) && (retry != 0)) {
+    status = transport_read(fd, c + length, bufsize - 1 - length,
+                            (length > 0) ? STREAM_GAP : 1000);
+    TIMING_BYTES_IN(status);
+    if ((status == 0) && (length > 0)) {
+      break; /* nothing more came */
+    }
+    if (status == 0) {
+      usleep(2000);
+      retry--;
+      continue;
+    }
+    if (status < 0) {
+      if (length == 0) {
+        restore_flags(fd, flags);
+        return status;
+      }
+      break;
+    }
 
-int my_atoi(char* t) {
-  int r = 0;
-
-  switch (t[0]) {
-  case '0':
-    r = 0;
-    break;
-  case '1':
-    r = 100;
-    break;
-  case '2':
-    r = 200;
-    break;
-  case '3':
-    r = 300;
-    break;
-  case '4':
-    r = 400;
-    break;
-  case '5':
-    r = 500;
-    break;
-  case '6':
-    r = 600;
-    break;
-  case '7':
-    r = 700;
-    break;
-  case '8':
-    r = 800;
-    break;
-  case '9':
-    r = 900;
-    break;
+    length += status;
+    if (stream_feed(parser, c + length - status, status)) {
+      break;
+    }
   }
-  
-  switch (t[1]) {
-  case '0':
-    r += 0;
-    break;
-  case '1':
-    r += 10;
-    break;
-  case '2':
-    r += 20;
-    break;
-  case '3':
-    r += 30;
-    break;
-  case '4':
-    r += 40;
-    break;
-  case '5':
-    r += 50;
-    break;
-  case '6':
-    r += 60;
-    break;
-  case '7':
-    r += 70;
-    break;
-  case '8':
-    r += 80;
-    break;
-  case '9':
-    r += 90;
-    break;
+
+  restore_flags(fd, flags);
+
+  if (length == 0) {
+    TIMING_TIMEOUT();
   }
 
-  switch (t[2]) {
-  case '0':
-    r += 0;
-    break;
-  case '1':
-    r += 1;
-    break;
-  case '2':
-    r += 2;
-    break;
-  case '3':
-    r += 3;
-    break;
-  case '4':
-    r += 4;
-    break;
-  case '5':
-    r += 5;
-    break;
-  case '6':
-    r += 6;
-    break;
-  case '7':
-    r += 7;
-    break;
-  case '8':
-    r += 8;
-    break;
-  case '9':
-    r += 9;
-    break;
+#ifdef DEBUG
+  if (length == 0) {
+    printf("Read from printer timed out\n");
+  } else if (!parser->complete) {
+    printf("Reply incomplete after %d bytes\n", length);
   }
-  
-  return r;
+#endif
+
+  return length;
 }
 
+
 /*
  * Parse device id string to tag value pair table
  */
@@ -383,3 +213,43 @@ int get_tag_index(char tags[NR_TAGS][BUFLEN], char *tag) {
 
   return -1;
 }
+
+/* FNV-1a, fast enough to hash every reply and good enough to tell
+ * whether it changed
+ */
+
+unsigned int hash_bytes(const void *data, const size_t length) {
+  const unsigned char *p = data;
+  unsigned int h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    h ^= p[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+/* The device may be kept open for the next query, whose reads expect it
+ * blocking again. Returns the flags to restore or -1.
+ */
+
+static int set_nonblocking(const int fd, const int nonblocking) {
+  int flags;
+
+  if (!nonblocking || !transport_is_fd() ||
+      (flags = fcntl(fd, F_GETFL)) < 0 || (flags & O_NONBLOCK)) {
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  return flags;
+}
+
+static void restore_flags(const int fd, const int flags) {
+  if (flags >= 0) {
+    fcntl(fd, F_SETFL, flags);
+  }
+}
@@ -8,10 +8,12 @@
 
 #include "internal.h"
 #include "inklevel.h"
+#include "stream.h"
 
 int read_from_printer(int fd, void *buf, size_t bufsize, int nonblocking);
-int my_axtoi(char *t);
-int my_atoi(char *t);
+int read_reply_from_printer(int fd, void *buf, size_t bufsize, int nonblocking,
+                            struct stream_parser *parser);
 void tokenize_device_id(const char *string, char tags[NR_TAGS][BUFLEN]);
 char *get_tag_value(char tags[NR_TAGS][BUFLEN], char *tag);
 int get_tag_index(char tags[NR_TAGS][BUFLEN], char *tag);
+unsigned int hash_bytes(const void *data, const size_t length);